@@ -115,10 +115,19 @@ void err_nonfatal(const char *s) {
 	fprintf(stderr, "Error: %s\nExiting.\n", s1);
 }
 
+/**
+ * If set, called by err() before it exits. nbd-server uses this to end
+ * only the thread of a connection rather than the whole process, if
+ * connections are served by threads.
+ **/
+void (*err_exit_hook)(void) = NULL;
+
 void err(const char *s) G_GNUC_NORETURN;
 
 void err(const char *s) {
 	err_nonfatal(s);
+	if(err_exit_hook)
+		err_exit_hook();
 	exit(EXIT_FAILURE);
 }
 
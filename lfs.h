@@ -15,5 +15,10 @@
 # define USE_SYNC_FILE_RANGE
 # define _GNU_SOURCE
 #endif /* HAVE_SYNC_FILE_RANGE */
+#if defined(HAVE_SPLICE) || defined(HAVE_ACCEPT4)
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif
+#endif /* HAVE_SPLICE || HAVE_ACCEPT4 */
 
 #endif /* LFS_H */
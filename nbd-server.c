@@ -65,6 +65,8 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
@@ -95,6 +97,22 @@
 #include <pwd.h>
 #include <grp.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
 #include <glib.h>
 
@@ -122,6 +140,29 @@ int glob_flags=0;
 /* Whether we should avoid forking */
 int dontfork = 0;
 
+/** Number of idle pre-forked workers to keep around; 0 to fork for every
+ * connection */
+int prefork = 0;
+
+/** Number of connections a pre-forked worker serves before it is
+ * replaced; 0 for no limit */
+int prefork_recycle = 0;
+
+/** Number of processes which accept connections on the modern port,
+ * each with a socket of its own */
+int listeners = 1;
+
+/** Which of those processes we are. The first one, 0, also serves the
+ * oldstyle ports, and started the others. */
+int listener_idx = 0;
+
+/** Shared between the listeners: the number of connections each of
+ * them serves, so that max_connections applies to all of them */
+gint *listenerconns = NULL;
+
+/** In the first listener, the PIDs of the others */
+GArray *listenerpids = NULL;
+
 /** Logging macros, now nothing goes to syslog unless you say ISSERVER */
 #ifdef ISSERVER
 #define msg(prio, ...) syslog(prio, __VA_ARGS__)
@@ -147,7 +188,35 @@ int dontfork = 0;
 #define LINELEN 256	  /**< Size of static buffer used to read the
 			       authorization file (yuck) */
 #define BUFSIZE ((1024*1024)+sizeof(struct nbd_reply)) /**< Size of buffer that can hold requests */
-#define DIFFPAGESIZE 4096 /**< diff file uses those chunks */
+#define DIFFPAGESIZE 4096 /**< diff file uses those chunks, unless the
+			       export has another cow_blocksize */
+#define COW_BLOCKSIZE_MAX (1024*1024) /**< largest cow_blocksize */
+#define COWMAP_BITS 9	  /**< each table of the copy-on-write map covers
+			       this many bits of a page number */
+#define COWMAP_FANOUT (1 << COWMAP_BITS) /**< entries in a table of the
+					   copy-on-write map */
+#define COWMAP_ABSENT ((u64)-1) /**< copy-on-write map entry of a page
+				     which isn't in the diff file */
+#define COWMAP_PENDING ((u64)-2) /**< copy-on-write map entry of a page
+				      which is being copied to the diff
+				      file */
+#define CACHEBLOCKSIZE 4096 /**< block cache uses those chunks */
+#define SHARED_CACHE_WAYS 4 /**< number of blocks in a set of a shared
+			      block cache */
+#define ASYNC_MAX_INFLIGHT 128 /**< maximum number of requests a connection
+				    may have queued to its I/O threads */
+#define URING_DEPTH 64	  /**< number of registered buffers, and thus of
+			       requests which fit in one, that a connection
+			       may have in flight with the io_uring engine */
+#define URING_BUFSIZE (128*1024) /**< size of each registered buffer */
+#define READAHEAD_RUN 3	  /**< number of reads in a row, each starting
+			       where the last one ended, after which a
+			       connection is taken to be streaming */
+#define READAHEAD_MIN (128*1024) /**< first read-ahead window of a stream */
+#define DROPBEHIND_CHUNK (1024*1024) /**< size of the ranges dropped from the
+				       page cache behind a stream */
+#define DROPBEHIND_MIN (8*1024*1024) /**< length of a stream after which
+				       fadvise = auto drops what it read */
 
 /** Per-export flags: */
 #define F_READONLY 1      /**< flag to tell us a file is readonly */
@@ -164,10 +233,15 @@ int dontfork = 0;
 #define F_TEMPORARY 1024  /**< Whether the backing file is temporary and should be created then unlinked */
 #define F_TRIM 2048       /**< Whether server wants TRIM (discard) to be sent by the client */
 #define F_FIXED 4096	  /**< Client supports fixed new-style protocol (and can thus send us extra options */
+#define F_SPLICE 8192	  /**< Whether to splice() written data from the socket to the export */
+#define F_DIRECT 16384	  /**< Whether to open the export with O_DIRECT */
+#define F_SHAREDCACHE 32768 /**< Whether to share the block cache between processes */
 
 /** Global flags: */
 #define F_OLDSTYLE 1	  /**< Allow oldstyle (port-based) exports */
 #define F_LIST 2	  /**< Allow clients to list the exports on a server */
+#define F_THREADED 4	  /**< Serve connections in threads rather than in
+			       processes of their own */
 GHashTable *children;
 char pidfname[256]; /**< name of our PID file */
 char pidftemplate[256]; /**< template to be used for the filename of the PID file */
@@ -181,6 +255,11 @@ static volatile sig_atomic_t is_sighup_caught; /**< Flag set by SIGHUP
                                                     handler to mark a
                                                     reconfiguration
                                                     request */
+static volatile sig_atomic_t is_export_stale; /**< Flag set by SIGUSR1
+						   handler when a child
+						   found an export in the
+						   registry to have
+						   changed */
 
 GArray* modernsocks;	  /**< Sockets for the modern handler. Not used
 			       if a client was only specified on the
@@ -191,6 +270,9 @@ GArray* modernsocks;	  /**< Sockets for the modern handler. Not used
 			       systems that don't support serving IPv4
 			       and IPv6 from the same socket (like,
 			       e.g., FreeBSD) */
+int listenfd = -1;	  /**< The epoll instance serveloop() waits on
+			       for connections to the listening sockets,
+			       if USE_EPOLL is defined */
 
 bool logged_oversized=false;  /**< whether we logged oversized requests already */
 
@@ -205,6 +287,32 @@ typedef enum {
 	VIRT_CIDR,	/**< Every subnet in its own directory */
 } VIRT_STYLE;
 
+/**
+ * Engines used to access the files of an export
+ **/
+typedef enum {
+	IOENGINE_SYNC=0,	/**< pread()/pwrite() from the thread handling
+				     the request */
+	IOENGINE_URING,		/**< io_uring, with many requests in flight
+				     at once */
+} IO_ENGINE;
+
+/**
+ * How the files of an export are expected to be accessed, as told to
+ * the kernel with posix_fadvise()
+ **/
+typedef enum {
+	FADVISE_NORMAL=0,	/**< no hint; the kernel's defaults */
+	FADVISE_RANDOM,		/**< random access; no read-ahead */
+	FADVISE_SEQUENTIAL,	/**< sequential access; more read-ahead */
+	FADVISE_NOREUSE,	/**< data is read once; drop it from the page
+				     cache behind sequential reads */
+	FADVISE_AUTO,		/**< drop data from the page cache behind
+				     sequential reads once they grow large */
+} FADVISE_MODE;
+
+typedef struct shared_cache SHARED_CACHE;
+
 /**
  * Variables associated with a server.
  **/
@@ -228,16 +336,58 @@ typedef struct {
 	gchar* servename;    /**< name of the export as selected by nbd-client */
 	int max_connections; /**< maximum number of opened connections */
 	gchar* transactionlog;/**< filename for transaction log */
+	int iothreads;	     /**< number of I/O threads per connection; 0 to
+				  handle requests synchronously */
+	IO_ENGINE ioengine;  /**< how to access the files of this export */
+	off_t writeback;     /**< number of bytes written to a file after which
+				  writeback of them is started; 0 to leave that
+				  to the kernel */
+	off_t cachesize;     /**< size of the block cache of the export; 0 for
+				  none */
+	SHARED_CACHE *sharedcache; /**< the block cache, if it is shared
+				     between processes */
+	off_t readahead;     /**< largest read-ahead window for clients which
+				  read sequentially; 0 to leave read-ahead
+				  to the kernel */
+	FADVISE_MODE fadvise; /**< how the files of this export are accessed */
+	int cowblocksize;    /**< size of the blocks which are copied to the
+				  diff file of a copy-on-write export */
 } SERVER;
 
+/**
+ * Writes to one file of an export for which writeback wasn't started
+ * yet, see pace_writeback()
+ **/
+typedef struct {
+	pthread_mutex_t lock;	/**< protects the rest */
+	off_t start;		/**< lowest offset written to */
+	off_t end;		/**< end of the highest write */
+	off_t pending;		/**< number of bytes written */
+} WRITEBACK;
+
 /**
  * Variables associated with a client socket.
  **/
 typedef struct {
 	int fhandle;      /**< file descriptor */
+	int dsynchandle;  /**< the same file opened with O_DSYNC, for FUA
+			    writes, or -1 if those must be synced */
 	off_t startoff;   /**< starting offset of this file */
+	off_t size;	  /**< size of this file when it was opened */
+	gint dirty;	  /**< number of times the file was changed without
+			    being synced right away */
+	gint clean;	  /**< what dirty was when the last sync of the file
+			    for a flush started; if it still is, the file
+			    needn't be synced */
+	WRITEBACK *writeback; /**< writes to pace, or NULL if writeback is
+				left to the kernel */
 } FILE_INFO;
 
+typedef struct uring_engine URING_ENGINE;
+typedef struct export_cache EXPORT_CACHE;
+typedef struct block_cache BLOCK_CACHE;
+typedef struct cow_map COW_MAP;
+
 typedef struct {
 	off_t exportsize;    /**< size of the file we're exporting */
 	char *clientname;    /**< peer */
@@ -251,13 +401,71 @@ typedef struct {
 	int difffile;	     /**< filedescriptor of copyonwrite file. @todo
 			       shouldn't this be an array too? (cfr export) Or
 			       make -m and -c mutually exclusive */
-	u32 difffilelen;     /**< number of pages in difffile */
-	u32 *difmap;	     /**< see comment on the global difmap for this one */
+	int difffiledsync;   /**< difffile opened with O_DSYNC, for FUA
+			       writes, or -1 if those must be synced */
+	u64 difffilelen;     /**< number of pages in difffile */
+	COW_MAP *difmap;     /**< where the pages of the export which were
+			       written to are in difffile */
+	pthread_rwlock_t cowlock; /**< protects difmap and difffilelen, but
+				    not the I/O on the pages they point to */
+	pthread_mutex_t cowwaitlock; /**< with cowdone, lets a write wait
+				       for pages it needs to be copied to
+				       difffile by another one */
+	pthread_cond_t cowdone; /**< broadcast when a copy to difffile
+				  ends */
+	gboolean nokernelcopy; /**< copying pages to difffile in the kernel
+				 failed, so it isn't tried anymore */
 	gboolean modern;     /**< client was negotiated using modern negotiation protocol */
 	int transactionlogfd;/**< fd for transaction log */
 	int clientfeats;     /**< Features supported by this client */
+	GThreadPool *pool;   /**< I/O threads handling requests for this
+			       client, or NULL if requests are handled
+			       synchronously */
+	int inflight;	     /**< number of requests queued to the pool that
+			       have not been replied to yet */
+	pthread_mutex_t lock;/**< protects inflight */
+	pthread_cond_t idle; /**< signalled whenever inflight drops */
+	pthread_mutex_t sendlock; /**< serializes replies on the socket */
+	int splicepipe[2];   /**< pipe used to splice() written data from the
+			       socket to the export, if F_SPLICE is set */
+	URING_ENGINE *uring; /**< the io_uring engine of this client, or NULL
+			       if it doesn't use one */
+	size_t directalign;  /**< alignment O_DIRECT needs for buffers,
+			       offsets and lengths, if F_DIRECT is set */
+	size_t directbufsize; /**< size of the buffers in bufpool */
+	GAsyncQueue *bufpool; /**< unused aligned buffers, if F_DIRECT is set */
+	pthread_mutex_t directlock; /**< serializes the read-modify-write cycles
+				      of unaligned O_DIRECT writes */
+	char *reqbuf;	     /**< the buffer mainloop() handles requests with,
+			       if it has one */
+	EXPORT_CACHE *cached; /**< the registry entry export belongs to, or
+				NULL if the files were opened for this client
+				alone */
+	BLOCK_CACHE *blockcache; /**< the block cache of the export, or NULL */
+	guint64 cachehits;   /**< blocks read from blockcache for this client */
+	guint64 cachemisses; /**< blocks it had to read from the files */
+	gint sharedepoch;    /**< epoch of the shared block cache our files
+			       belong to, or 0 if there's no such cache */
+	off_t ranext;	     /**< where the last read ended */
+	int rarun;	     /**< number of reads in a row which started there */
+	off_t rawindow;	     /**< current read-ahead window; 0 if the client
+			       isn't streaming */
+	off_t raend;	     /**< where what was read ahead ends */
+	off_t rastart;	     /**< where the current stream of reads started */
+	off_t radropped;     /**< up to where the stream was dropped from the
+			       page cache */
 } CLIENT;
 
+/**
+ * A request which has been handed to the I/O threads of a client
+ **/
+typedef struct {
+	struct nbd_request request; /**< the request, as read by mainloop() */
+	size_t len;		    /**< length of the request, in host order */
+	char *buf;		    /**< the data to be written, or the buffer
+				      to read into */
+} ASYNC_REQ;
+
 /**
  * Type of configuration file values
  **/
@@ -294,6 +502,9 @@ struct generic_conf {
         gchar *modernaddr;      /**< address of the modern socket */
         gchar *modernport;      /**< port of the modern socket    */
         gint flags;             /**< global flags                 */
+        gint prefork;           /**< number of pre-forked workers */
+        gint prefork_recycle;   /**< connections per worker       */
+        gint listeners;         /**< processes on the modern port */
 };
 
 /**
@@ -513,6 +724,7 @@ SERVER* cmdline(int argc, char *argv[]) {
 	serve=g_new0(SERVER, 1);
 	serve->authname = g_strdup(default_authname);
 	serve->virtstyle=VIRT_IPLIT;
+	serve->cowblocksize=DIFFPAGESIZE;
 	while((c=getopt_long(argc, argv, "-C:cdl:mo:rp:M:", long_options, &i))>=0) {
 		switch (c) {
 		case 1:
@@ -643,11 +855,13 @@ typedef enum {
         NBDS_ERR_SO_LINGER,               /**< Failed to set SO_LINGER to a socket */
         NBDS_ERR_SO_REUSEADDR,            /**< Failed to set SO_REUSEADDR to a socket */
         NBDS_ERR_SO_KEEPALIVE,            /**< Failed to set SO_KEEPALIVE to a socket */
+        NBDS_ERR_SO_REUSEPORT,            /**< Failed to set SO_REUSEPORT to a socket */
         NBDS_ERR_GAI,                     /**< Failed to get address info */
         NBDS_ERR_SOCKET,                  /**< Failed to create a socket */
         NBDS_ERR_BIND,                    /**< Failed to bind an address to socket */
         NBDS_ERR_LISTEN,                  /**< Failed to start listening on a socket */
         NBDS_ERR_SYS,                     /**< Underlying system call or library error */
+        NBDS_ERR_EXPORT,                  /**< Failed to open or size the files of an export */
 } NBDS_ERRS;
 
 /**
@@ -694,6 +908,13 @@ SERVER* dup_serve(const SERVER *const s) {
 		serve->servename = g_strdup(s->servename);
 
 	serve->max_connections = s->max_connections;
+	serve->iothreads = s->iothreads;
+	serve->ioengine = s->ioengine;
+	serve->writeback = s->writeback;
+	serve->cachesize = s->cachesize;
+	serve->readahead = s->readahead;
+	serve->fadvise = s->fadvise;
+	serve->cowblocksize = s->cowblocksize;
 
 	return serve;
 }
@@ -851,6 +1072,8 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, GError** e) {
 	gchar* cfdir = NULL;
 	SERVER s;
 	gchar *virtstyle=NULL;
+	gchar *ioengine=NULL;
+	gchar *fadvise=NULL;
 	PARAM lp[] = {
 		{ "exportname", TRUE,	PARAM_STRING, 	&(s.exportname),	0 },
 		{ "port", 	TRUE,	PARAM_INT, 	&(s.port),		0 },
@@ -865,6 +1088,8 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, GError** e) {
 		{ "copyonwrite", FALSE,	PARAM_BOOL,	&(s.flags),		F_COPYONWRITE },
 		{ "sparse_cow",	FALSE,	PARAM_BOOL,	&(s.flags),		F_SPARSE },
 		{ "sdp",	FALSE,	PARAM_BOOL,	&(s.flags),		F_SDP },
+		{ "splice",	FALSE,	PARAM_BOOL,	&(s.flags),		F_SPLICE },
+		{ "direct",	FALSE,	PARAM_BOOL,	&(s.flags),		F_DIRECT },
 		{ "sync",	FALSE,  PARAM_BOOL,	&(s.flags),		F_SYNC },
 		{ "flush",	FALSE,  PARAM_BOOL,	&(s.flags),		F_FLUSH },
 		{ "fua",	FALSE,  PARAM_BOOL,	&(s.flags),		F_FUA },
@@ -873,6 +1098,14 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, GError** e) {
 		{ "trim",	FALSE,  PARAM_BOOL,	&(s.flags),		F_TRIM },
 		{ "listenaddr", FALSE,  PARAM_STRING,   &(s.listenaddr),	0 },
 		{ "maxconnections", FALSE, PARAM_INT,	&(s.max_connections),	0 },
+		{ "iothreads",	FALSE,	PARAM_INT,	&(s.iothreads),		0 },
+		{ "ioengine",	FALSE,	PARAM_STRING,	&(ioengine),		0 },
+		{ "writeback",	FALSE,	PARAM_OFFT,	&(s.writeback),		0 },
+		{ "cachesize",	FALSE,	PARAM_OFFT,	&(s.cachesize),		0 },
+		{ "sharedcache", FALSE,	PARAM_BOOL,	&(s.flags),		F_SHAREDCACHE },
+		{ "readahead",	FALSE,	PARAM_OFFT,	&(s.readahead),		0 },
+		{ "fadvise",	FALSE,	PARAM_STRING,	&(fadvise),		0 },
+		{ "cow_blocksize", FALSE, PARAM_INT,	&(s.cowblocksize),	0 },
 	};
 	const int lp_size=sizeof(lp)/sizeof(PARAM);
         struct generic_conf genconftmp;
@@ -884,6 +1117,10 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, GError** e) {
 		{ "port", 	FALSE, PARAM_STRING,	&(genconftmp.modernport), 0 },
 		{ "includedir", FALSE, PARAM_STRING,	&cfdir,                   0 },
 		{ "allowlist",  FALSE, PARAM_BOOL,	&(genconftmp.flags),      F_LIST },
+		{ "prefork",	FALSE, PARAM_INT,	&(genconftmp.prefork),    0 },
+		{ "prefork_recycle", FALSE, PARAM_INT,	&(genconftmp.prefork_recycle), 0 },
+		{ "threaded",	FALSE, PARAM_BOOL,	&(genconftmp.flags),      F_THREADED },
+		{ "listeners",	FALSE, PARAM_INT,	&(genconftmp.listeners),  0 },
 	};
 	PARAM* p=gp;
 	int p_size=sizeof(gp)/sizeof(PARAM);
@@ -1025,6 +1262,60 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, GError** e) {
 		} else {
 			s.virtstyle=VIRT_IPLIT;
 		}
+		if(ioengine) {
+			if(!strcmp(ioengine, "sync")) {
+				s.ioengine=IOENGINE_SYNC;
+			} else if(!strcmp(ioengine, "uring")) {
+#ifdef HAVE_LIBURING
+				s.ioengine=IOENGINE_URING;
+#else
+				g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_UNSUPPORTED, "This nbd-server was built without support for io_uring, yet group %s uses it", groups[i]);
+				g_free(ioengine);
+				g_array_free(retval, TRUE);
+				g_key_file_free(cfile);
+				return NULL;
+#endif
+			} else {
+				g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value %s for parameter ioengine in group %s", ioengine, groups[i]);
+				g_free(ioengine);
+				g_array_free(retval, TRUE);
+				g_key_file_free(cfile);
+				return NULL;
+			}
+			g_free(ioengine);
+			ioengine=NULL;
+		}
+		if(fadvise) {
+			if(!strcmp(fadvise, "normal")) {
+				s.fadvise=FADVISE_NORMAL;
+			} else if(!strcmp(fadvise, "random")) {
+				s.fadvise=FADVISE_RANDOM;
+			} else if(!strcmp(fadvise, "sequential")) {
+				s.fadvise=FADVISE_SEQUENTIAL;
+			} else if(!strcmp(fadvise, "noreuse")) {
+				s.fadvise=FADVISE_NOREUSE;
+			} else if(!strcmp(fadvise, "auto")) {
+				s.fadvise=FADVISE_AUTO;
+			} else {
+				g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value %s for parameter fadvise in group %s", fadvise, groups[i]);
+				g_free(fadvise);
+				g_array_free(retval, TRUE);
+				g_key_file_free(cfile);
+				return NULL;
+			}
+			g_free(fadvise);
+			fadvise=NULL;
+		}
+		if(!s.cowblocksize) {
+			s.cowblocksize=DIFFPAGESIZE;
+		} else if(s.cowblocksize < DIFFPAGESIZE ||
+			  s.cowblocksize > COW_BLOCKSIZE_MAX ||
+			  (s.cowblocksize & (s.cowblocksize - 1))) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value %d for parameter cow_blocksize in group %s: must be a power of two from %d to %d", s.cowblocksize, groups[i], DIFFPAGESIZE, COW_BLOCKSIZE_MAX);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
 		if(s.port && !(glob_flags & F_OLDSTYLE)) {
 			g_warning("A port was specified, but oldstyle exports were not requested. This may not do what you expect.");
 			g_warning("Please read 'man 5 nbd-server' and search for oldstyle for more info");
@@ -1045,6 +1336,22 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, GError** e) {
 			g_key_file_free(cfile);
 			return NULL;
 		}
+#endif
+#ifndef HAVE_SPLICE
+		if(s.flags & F_SPLICE) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_UNSUPPORTED, "This nbd-server was built without support for splice(), yet group %s uses it", groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+#endif
+#ifndef O_DIRECT
+		if(s.flags & F_DIRECT) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_UNSUPPORTED, "This nbd-server was built without support for O_DIRECT, yet group %s uses it", groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
 #endif
 	}
 	g_key_file_free(cfile);
@@ -1074,6 +1381,28 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, GError** e) {
 	return retval;
 }
 
+static void publish_connections(void);
+
+/**
+ * Check whether a child is one of the other listeners, and if so, stop
+ * counting the connections it served.
+ *
+ * @return TRUE if it was a listener
+ **/
+static gboolean reap_listener(pid_t pid) {
+	int i;
+
+	for(i=0; listenerpids && i<listenerpids->len; i++) {
+		if(g_array_index(listenerpids, pid_t, i) == pid) {
+			msg(LOG_ERR, "Listener %d exited", i + 1);
+			g_atomic_int_set(&listenerconns[i + 1], 0);
+			g_array_remove_index_fast(listenerpids, i);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 /**
  * Signal handler for SIGCHLD
  * @param s the signal we're handling (must be SIGCHLD, or something
@@ -1088,6 +1417,9 @@ void sigchld_handler(int s) {
 		if(WIFEXITED(status)) {
 			msg(LOG_INFO, "Child exited with %d", WEXITSTATUS(status));
 		}
+		if(reap_listener(pid)) {
+			continue;
+		}
 		i=g_hash_table_lookup(children, &pid);
 		if(!i) {
 			msg(LOG_INFO, "SIGCHLD received for an unknown child with PID %ld", (long)pid);
@@ -1096,6 +1428,7 @@ void sigchld_handler(int s) {
 			g_hash_table_remove(children, &pid);
 		}
 	}
+	publish_connections();
 }
 
 /**
@@ -1118,6 +1451,11 @@ void killchild(gpointer key, gpointer value, gpointer user_data) {
  * is severely wrong).
  **/
 void sigterm_handler(int s) {
+	int i;
+
+	for(i=0; listenerpids && i<listenerpids->len; i++) {
+		kill(g_array_index(listenerpids, pid_t, i), SIGTERM);
+	}
 	g_hash_table_foreach(children, killchild, NULL);
 	unlink(pidfname);
 
@@ -1137,6 +1475,17 @@ static void sighup_handler(const int s G_GNUC_UNUSED) {
         is_sighup_caught = 1;
 }
 
+/**
+ * Handle SIGUSR1, which a child sends when the files of an export it
+ * got from the registry turned out to have changed, by setting a flag
+ * for the main loop, which opens the export again.
+ *
+ * @param s the signal we're handling (must be SIGUSR1)
+ **/
+static void export_stale_handler(const int s G_GNUC_UNUSED) {
+	is_export_stale = 1;
+}
+
 /**
  * Detect the size of a file.
  *
@@ -1185,17 +1534,14 @@ off_t size_autodetect(int fhandle) {
 }
 
 /**
- * Get the file handle and offset, given an export offset.
+ * Get the index of the file in an export array which holds a given
+ * export offset.
  *
  * @param export An array of export files
- * @param a The offset to get corresponding file/offset for
- * @param fhandle [out] File descriptor
- * @param foffset [out] Offset into fhandle
- * @param maxbytes [out] Tells how many bytes can be read/written
- * from fhandle starting at foffset (0 if there is no limit)
- * @return 0 on success, -1 on failure
+ * @param a The offset to look up
+ * @return the index into export, or -1 on failure
  **/
-int get_filepos(GArray* export, off_t a, int* fhandle, off_t* foffset, size_t* maxbytes ) {
+int get_fileidx(GArray* export, off_t a) {
 	/* Negative offset not allowed */
 	if(a < 0)
 		return -1;
@@ -1220,6 +1566,27 @@ int get_filepos(GArray* export, off_t a, int* fhandle, off_t* foffset, size_t* m
 	/* end should never go negative, since first startoff is 0 and a >= 0 */
 	assert(end >= 0);
 
+	return end;
+}
+
+/**
+ * Get the file handle and offset, given an export offset.
+ *
+ * @param export An array of export files
+ * @param a The offset to get corresponding file/offset for
+ * @param fhandle [out] File descriptor
+ * @param foffset [out] Offset into fhandle
+ * @param maxbytes [out] Tells how many bytes can be read/written
+ * from fhandle starting at foffset (0 if there is no limit)
+ * @return 0 on success, -1 on failure
+ **/
+int get_filepos(GArray* export, off_t a, int* fhandle, off_t* foffset, size_t* maxbytes ) {
+	FILE_INFO fi;
+	int end = get_fileidx(export, a);
+
+	if(end < 0)
+		return -1;
+
 	fi = g_array_index(export, FILE_INFO, end);
 	*fhandle = fi.fhandle;
 	*foffset = a - fi.startoff;
@@ -1233,274 +1600,2121 @@ int get_filepos(GArray* export, off_t a, int* fhandle, off_t* foffset, size_t* m
 }
 
 /**
- * seek to a position in a file, with error handling.
- * @param handle a filedescriptor
- * @param a position to seek to
- * @todo get rid of this; lastpoint is a global variable right now, but it
- * shouldn't be. If we pass it on as a parameter, that makes things a *lot*
- * easier.
+ * Get a buffer to hold the data of a request. For exports which use
+ * O_DIRECT, the buffer is taken from a pool of buffers which are
+ * aligned as O_DIRECT requires, so that the data can be read or written
+ * without going through a bounce buffer.
+ *
+ * @param client The client the request is for
+ * @param len The number of bytes the buffer must hold; at most
+ * client->directbufsize if F_DIRECT is set
+ * @return The buffer; release it with put_buffer()
  **/
-void myseek(int handle,off_t a) {
-	if (lseek(handle, a, SEEK_SET) < 0) {
-		err("Can not seek locally!\n");
-	}
+static char *get_buffer(CLIENT *client, size_t len) {
+	char *buf;
+
+	if(!(client->server->flags & F_DIRECT))
+		return g_malloc(len);
+	assert(len <= client->directbufsize);
+	if((buf = g_async_queue_try_pop(client->bufpool)))
+		return buf;
+	if(posix_memalign((void**)&buf, client->directalign,
+			  client->directbufsize))
+		err("Could not allocate memory");
+	return buf;
 }
 
 /**
- * Write an amount of bytes at a given offset to the right file. This
- * abstracts the write-side of the multiple file option.
- *
- * @param a The offset where the write should start
- * @param buf The buffer to write from
- * @param len The length of buf
- * @param client The client we're serving for
- * @param fua Flag to indicate 'Force Unit Access'
- * @return The number of bytes actually written, or -1 in case of an error
+ * Release a buffer obtained with get_buffer().
  **/
-ssize_t rawexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
-	int fhandle;
-	off_t foffset;
-	size_t maxbytes;
-	ssize_t retval;
-
-	if(get_filepos(client->export, a, &fhandle, &foffset, &maxbytes))
-		return -1;
-	if(maxbytes && len > maxbytes)
-		len = maxbytes;
-
-	DEBUG("(WRITE to fd %d offset %llu len %u fua %d), ", fhandle, (long long unsigned)foffset, (unsigned int)len, fua);
-
-	myseek(fhandle, foffset);
-	retval = write(fhandle, buf, len);
-	if(client->server->flags & F_SYNC) {
-		fsync(fhandle);
-	} else if (fua) {
-
-	  /* This is where we would do the following
-	   *   #ifdef USE_SYNC_FILE_RANGE
-	   * However, we don't, for the reasons set out below
-	   * by Christoph Hellwig <hch@infradead.org>
-	   *
-	   * [BEGINS] 
-	   * fdatasync is equivalent to fsync except that it does not flush
-	   * non-essential metadata (basically just timestamps in practice), but it
-	   * does flush metadata requried to find the data again, e.g. allocation
-	   * information and extent maps.  sync_file_range does nothing but flush
-	   * out pagecache content - it means you basically won't get your data
-	   * back in case of a crash if you either:
-	   * 
-	   *  a) have a volatile write cache in your disk (e.g. any normal SATA disk)
-	   *  b) are using a sparse file on a filesystem
-	   *  c) are using a fallocate-preallocated file on a filesystem
-	   *  d) use any file on a COW filesystem like btrfs
-	   * 
-	   * e.g. it only does anything useful for you if you do not have a volatile
-	   * write cache, and either use a raw block device node, or just overwrite
-	   * an already fully allocated (and not preallocated) file on a non-COW
-	   * filesystem.
-	   * [ENDS]
-	   *
-	   * What we should do is open a second FD with O_DSYNC set, then write to
-	   * that when appropriate. However, with a Linux client, every REQ_FUA
-	   * immediately follows a REQ_FLUSH, so fdatasync does not cause performance
-	   * problems.
-	   *
-	   */
-#if 0
-		sync_file_range(fhandle, foffset, len,
-				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
-				SYNC_FILE_RANGE_WAIT_AFTER);
-#else
-		fdatasync(fhandle);
-#endif
+static void put_buffer(CLIENT *client, char *buf) {
+	if(!(client->server->flags & F_DIRECT)) {
+		g_free(buf);
+		return;
 	}
-	return retval;
+	if(buf)
+		g_async_queue_push(client->bufpool, buf);
 }
 
 /**
- * Call rawexpwrite repeatedly until all data has been written.
- *
- * @param a The offset where the write should start
- * @param buf The buffer to write from
- * @param len The length of buf
- * @param client The client we're serving for
- * @param fua Flag to indicate 'Force Unit Access'
- * @return 0 on success, nonzero on failure
+ * Check whether a transfer can be done with O_DIRECT as it is, without
+ * a bounce buffer.
  **/
-int rawexpwrite_fully(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
-	ssize_t ret=0;
+static gboolean is_direct_aligned(CLIENT *client, char *buf, size_t len,
+				  off_t foffset) {
+	size_t mask = client->directalign - 1;
 
-	while(len > 0 && (ret=rawexpwrite(a, buf, len, client, fua)) > 0 ) {
-		a += ret;
-		buf += ret;
-		len -= ret;
-	}
-	return (ret < 0 || len != 0);
+	return !((uintptr_t)buf & mask) && !(len & mask) && !(foffset & mask);
 }
 
 /**
- * Read an amount of bytes at a given offset from the right file. This
- * abstracts the read-side of the multiple files option.
+ * pread() from a file opened with O_DIRECT. Reads which aren't aligned
+ * go through a bounce buffer covering the aligned blocks around them.
  *
- * @param a The offset where the read should start
- * @param buf A buffer to read into
- * @param len The size of buf
- * @param client The client we're serving for
- * @return The number of bytes actually read, or -1 in case of an
- * error.
+ * @return The number of bytes read, which may be less than len, or -1
+ * in case of an error
  **/
-ssize_t rawexpread(off_t a, char *buf, size_t len, CLIENT *client) {
-	int fhandle;
-	off_t foffset;
-	size_t maxbytes;
-
-	if(get_filepos(client->export, a, &fhandle, &foffset, &maxbytes))
-		return -1;
-	if(maxbytes && len > maxbytes)
-		len = maxbytes;
-
-	DEBUG("(READ from fd %d offset %llu len %u), ", fhandle, (long long unsigned int)foffset, (unsigned int)len);
-
-	myseek(fhandle, foffset);
-	return read(fhandle, buf, len);
+static ssize_t direct_pread(CLIENT *client, int fhandle, char *buf,
+			    size_t len, off_t foffset) {
+	off_t start;
+	size_t skip;
+	size_t rdlen;
+	ssize_t ret;
+	char *bounce;
+
+	if(is_direct_aligned(client, buf, len, foffset))
+		return pread(fhandle, buf, len, foffset);
+
+	skip = foffset & (client->directalign - 1);
+	start = foffset - skip;
+	if(len > client->directbufsize - skip)
+		len = client->directbufsize - skip;
+	rdlen = (skip + len + client->directalign - 1) & ~(client->directalign - 1);
+	bounce = get_buffer(client, rdlen);
+	ret = pread(fhandle, bounce, rdlen, start);
+	if(ret > 0) {
+		ret = (ret > skip) ? ret - skip : 0;
+		if(ret > len)
+			ret = len;
+		memcpy(buf, bounce + skip, ret);
+	}
+	put_buffer(client, bounce);
+	return ret;
 }
 
 /**
- * Call rawexpread repeatedly until all data has been read.
- * @return 0 on success, nonzero on failure
+ * pwrite() to a file opened with O_DIRECT. Writes which aren't aligned
+ * read the partial blocks at either end first, and write the aligned
+ * blocks around them from a bounce buffer.
+ *
+ * @return The number of bytes written, which may be less than len, or
+ * -1 in case of an error
  **/
-int rawexpread_fully(off_t a, char *buf, size_t len, CLIENT *client) {
-	ssize_t ret=0;
-
-	while(len > 0 && (ret=rawexpread(a, buf, len, client)) > 0 ) {
-		a += ret;
-		buf += ret;
-		len -= ret;
+static ssize_t direct_pwrite(CLIENT *client, int fhandle, char *buf,
+			     size_t len, off_t foffset) {
+	size_t align = client->directalign;
+	off_t start;
+	size_t skip;
+	size_t wrlen;
+	ssize_t ret;
+	char *bounce;
+
+	if(is_direct_aligned(client, buf, len, foffset))
+		return pwrite(fhandle, buf, len, foffset);
+
+	skip = foffset & (align - 1);
+	start = foffset - skip;
+	if(len > client->directbufsize - skip)
+		len = client->directbufsize - skip;
+	wrlen = (skip + len + align - 1) & ~(align - 1);
+	bounce = get_buffer(client, wrlen);
+
+	pthread_mutex_lock(&client->directlock);
+	if(skip) {
+		ret = pread(fhandle, bounce, align, start);
+		if(ret < 0)
+			goto out;
+		memset(bounce + ret, 0, align - ret);
+	}
+	if((skip + len) & (align - 1) && (!skip || wrlen > align)) {
+		ret = pread(fhandle, bounce + wrlen - align, align,
+			    start + wrlen - align);
+		if(ret < 0)
+			goto out;
+		memset(bounce + wrlen - align + ret, 0, align - ret);
 	}
-	return (ret < 0 || len != 0);
+	memcpy(bounce + skip, buf, len);
+	ret = pwrite(fhandle, bounce, wrlen, start);
+	if(ret > 0) {
+		ret = (ret > skip) ? ret - skip : 0;
+		if(ret > len)
+			ret = len;
+	}
+out:
+	pthread_mutex_unlock(&client->directlock);
+	put_buffer(client, bounce);
+	return ret;
 }
 
 /**
- * Read an amount of bytes at a given offset from the right file. This
- * abstracts the read-side of the copyonwrite stuff, and calls
- * rawexpread() with the right parameters to do the actual work.
- * @param a The offset where the read should start
- * @param buf A buffer to read into
- * @param len The size of buf
- * @param client The client we're going to read for
- * @return 0 on success, nonzero on failure
+ * Find out how much of a range of the export falls within one of its
+ * files, so that a request can be split up without looking up every
+ * part of it again.
+ *
+ * @param export An array of export files
+ * @param i The index of the file in export which holds offset a, as
+ * returned by get_fileidx()
+ * @param a The offset where the range starts
+ * @param len The length of the range
+ * @return The number of bytes of the range which are in file i
  **/
-int expread(off_t a, char *buf, size_t len, CLIENT *client) {
-	off_t rdlen, offset;
-	off_t mapcnt, mapl, maph, pagestart;
-
-	if (!(client->server->flags & F_COPYONWRITE))
-		return(rawexpread_fully(a, buf, len, client));
-	DEBUG("Asked to read %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+static size_t get_segment_len(GArray* export, int i, off_t a, size_t len) {
+	off_t next;
 
-	mapl=a/DIFFPAGESIZE; maph=(a+len-1)/DIFFPAGESIZE;
-
-	for (mapcnt=mapl;mapcnt<=maph;mapcnt++) {
-		pagestart=mapcnt*DIFFPAGESIZE;
-		offset=a-pagestart;
-		rdlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
-			len : (size_t)DIFFPAGESIZE-offset;
-		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
-			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt]));
-			myseek(client->difffile, client->difmap[mapcnt]*DIFFPAGESIZE+offset);
-			if (read(client->difffile, buf, rdlen) != rdlen) return -1;
-		} else { /* the block is not there */
-			DEBUG("Page %llu is not here, we read the original one\n",
-			       (unsigned long long)mapcnt);
-			if(rawexpread_fully(a, buf, rdlen, client)) return -1;
-		}
-		len-=rdlen; a+=rdlen; buf+=rdlen;
+	if(i + 1 < export->len) {
+		next = g_array_index(export, FILE_INFO, i + 1).startoff;
+		if(next - a < len)
+			return next - a;
 	}
-	return 0;
+	return len;
 }
 
 /**
- * Write an amount of bytes at a given offset to the right file. This
- * abstracts the write-side of the copyonwrite option, and calls
- * rawexpwrite() with the right parameters to do the actual work.
+ * The syncs of one file, shared by every thread which writes to it, so
+ * that concurrent flushes and FUA writes can share a sync instead of
+ * each doing their own, one after the other.
+ **/
+typedef struct {
+	pthread_mutex_t lock;	/**< protects the rest */
+	pthread_cond_t done;	/**< signalled whenever a sync finishes */
+	gboolean running;	/**< whether a sync is being done */
+	guint64 started;	/**< number of syncs started */
+	guint64 finished;	/**< number of the last sync which finished */
+	guint64 failed;		/**< number of the last sync which failed */
+	int error;		/**< errno of that sync */
+} SYNC_GROUP;
+
+GHashTable *syncgroups = NULL;	/**< the SYNC_GROUP of each file descriptor,
+				     for fsync() and fdatasync() apart */
+pthread_mutex_t syncgroupslock = PTHREAD_MUTEX_INITIALIZER; /**< protects
+								  syncgroups */
+
+/**
+ * Sync a file, sharing the sync with other threads which want the same
+ * file synced at the same time (group commit). A sync which was started
+ * before we were called may have missed what was just written, so we
+ * wait for it to finish and then do another one, which covers everyone
+ * who came in while the first one was running.
  *
- * @param a The offset where the write should start
- * @param buf The buffer to write from
- * @param len The length of buf
- * @param client The client we're going to write for.
- * @param fua Flag to indicate 'Force Unit Access'
- * @return 0 on success, nonzero on failure
+ * @param fhandle The file to sync
+ * @param datasync TRUE for fdatasync(), FALSE for fsync()
+ * @return 0 on success, -1 (with errno set) if a sync done on our
+ * behalf failed
  **/
-int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
-	char pagebuf[DIFFPAGESIZE];
-	off_t mapcnt,mapl,maph;
-	off_t wrlen,rdlen; 
-	off_t pagestart;
-	off_t offset;
+static int group_sync(int fhandle, gboolean datasync) {
+	SYNC_GROUP *group;
+	gpointer key = GINT_TO_POINTER(fhandle * 2 + (datasync ? 1 : 0));
+	guint64 target;
+	guint64 mine;
+	int ret;
 
-	if (!(client->server->flags & F_COPYONWRITE))
-		return(rawexpwrite_fully(a, buf, len, client, fua)); 
-	DEBUG("Asked to write %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+	pthread_mutex_lock(&syncgroupslock);
+	if(!syncgroups) {
+		syncgroups = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	if(!(group = g_hash_table_lookup(syncgroups, key))) {
+		group = g_new0(SYNC_GROUP, 1);
+		pthread_mutex_init(&group->lock, NULL);
+		pthread_cond_init(&group->done, NULL);
+		g_hash_table_insert(syncgroups, key, group);
+	}
+	pthread_mutex_unlock(&syncgroupslock);
 
-	mapl=a/DIFFPAGESIZE ; maph=(a+len-1)/DIFFPAGESIZE ;
-
-	for (mapcnt=mapl;mapcnt<=maph;mapcnt++) {
-		pagestart=mapcnt*DIFFPAGESIZE ;
-		offset=a-pagestart ;
-		wrlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
-			len : (size_t)DIFFPAGESIZE-offset;
-
-		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
-			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt])) ;
-			myseek(client->difffile,
-					client->difmap[mapcnt]*DIFFPAGESIZE+offset);
-			if (write(client->difffile, buf, wrlen) != wrlen) return -1 ;
-		} else { /* the block is not there */
-			myseek(client->difffile,client->difffilelen*DIFFPAGESIZE) ;
-			client->difmap[mapcnt]=(client->server->flags&F_SPARSE)?mapcnt:client->difffilelen++;
-			DEBUG("Page %llu is not here, we put it at %lu\n",
-			       (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt]));
-			rdlen=DIFFPAGESIZE ;
-			if (rawexpread_fully(pagestart, pagebuf, rdlen, client))
-				return -1;
-			memcpy(pagebuf+offset,buf,wrlen) ;
-			if (write(client->difffile, pagebuf, DIFFPAGESIZE) !=
-					DIFFPAGESIZE)
-				return -1;
-		}						    
-		len-=wrlen ; a+=wrlen ; buf+=wrlen ;
+	pthread_mutex_lock(&group->lock);
+	target = group->started + 1;
+	while(group->finished < target) {
+		if(group->running) {
+			pthread_cond_wait(&group->done, &group->lock);
+			continue;
+		}
+		group->running = TRUE;
+		mine = ++group->started;
+		pthread_mutex_unlock(&group->lock);
+		ret = datasync ? fdatasync(fhandle) : fsync(fhandle);
+		pthread_mutex_lock(&group->lock);
+		if(ret < 0) {
+			group->failed = mine;
+			group->error = errno;
+		}
+		group->finished = mine;
+		group->running = FALSE;
+		pthread_cond_broadcast(&group->done);
 	}
-	if (client->server->flags & F_SYNC) {
-		fsync(client->difffile);
-	} else if (fua) {
-		/* open question: would it be cheaper to do multiple sync_file_ranges?
-		   as we iterate through the above?
-		 */
-		fdatasync(client->difffile);
+	ret = 0;
+	if(group->failed >= target) {
+		errno = group->error;
+		ret = -1;
 	}
-	return 0;
+	pthread_mutex_unlock(&group->lock);
+	return ret;
 }
 
 /**
- * Flush data to a client
+ * Note that a file of the export was changed, so that the next flush
+ * syncs it.
  *
- * @param client The client we're going to write for.
- * @return 0 on success, nonzero on failure
+ * @param export The files of the export
+ * @param i The index of the file in export
  **/
-int expflush(CLIENT *client) {
-	gint i;
+static void mark_dirty(GArray *export, int i) {
+	g_atomic_int_inc(&g_array_index(export, FILE_INFO, i).dirty);
+}
+
+/**
+ * Note that all files of a client's export may have changes which
+ * weren't synced. A connection can't tell what a previous one left
+ * unsynced in files it inherited from the registry, or from the
+ * process it was forked from, so the first flush must sync them all.
+ *
+ * @param client The client which is about to be served
+ **/
+static void mark_export_dirty(CLIENT *client) {
+	int i;
+
+	for(i=0; i<client->export->len; i++)
+		mark_dirty(client->export, i);
+}
+
+/**
+ * Note that a file of the export was synced for a flush, and with it
+ * all changes up to the given one.
+ *
+ * @param fi The file
+ * @param dirty What fi->dirty was when the sync started
+ **/
+static void mark_clean(FILE_INFO *fi, gint dirty) {
+	gint clean;
+
+	/* Another flush may have got further in the mean time */
+	do {
+		clean = g_atomic_int_get(&fi->clean);
+		if((gint)((guint)dirty - (guint)clean) <= 0)
+			return;
+	} while(!g_atomic_int_compare_and_exchange(&fi->clean, clean, dirty));
+}
+
+/**
+ * Which queue of a block cache a block is on. The cache uses the 2Q
+ * replacement policy: blocks which were read once go on a1in, from
+ * which they are evicted first in, first out, so that a client which
+ * reads through a whole image once doesn't push out the blocks which
+ * are read over and over. A block which is read again after it was
+ * evicted from a1in is remembered on a1out, and goes on am, which is
+ * kept in least recently used order.
+ **/
+typedef enum {
+	CACHE_A1IN = 0,		/**< read once, recently */
+	CACHE_AM = 1,		/**< read more than once */
+	CACHE_A1OUT = 2,	/**< evicted from a1in; only its number is kept */
+} CACHE_QUEUE;
+
+typedef struct cache_block CACHE_BLOCK;
+
+/**
+ * A block in a block cache
+ **/
+struct cache_block {
+	gint64 blknum;		/**< number of the block in the export */
+	CACHE_QUEUE queue;	/**< the queue the block is on */
+	char *data;		/**< the data of the block, or NULL on a1out */
+	CACHE_BLOCK *prev;	/**< the block before it on its queue */
+	CACHE_BLOCK *next;	/**< the block after it on its queue */
+};
+
+/**
+ * One of the queues of a block cache
+ **/
+typedef struct {
+	CACHE_BLOCK *head;	/**< the most recently added block */
+	CACHE_BLOCK *tail;	/**< the block which goes next */
+	int len;		/**< number of blocks on the queue */
+} CACHE_LIST;
+
+/**
+ * Blocks of an export which were read from its files, shared by all
+ * connections of this process which use the same files
+ **/
+struct block_cache {
+	pthread_mutex_t lock;	/**< protects the rest */
+	dev_t dev;		/**< device of the first file of the export */
+	ino_t ino;		/**< inode of that file */
+	int refcount;		/**< number of opened exports using the cache */
+	GHashTable *blocks;	/**< the CACHE_BLOCK of each block number */
+	CACHE_LIST queues[3];	/**< indexed by CACHE_QUEUE */
+	int maxblocks;		/**< number of blocks the cache holds data of */
+	int maxa1in;		/**< number of blocks a1in may keep while am
+				  is not empty */
+	int maxa1out;		/**< number of blocks remembered on a1out */
+	guint generation;	/**< incremented by every invalidation */
+	guint64 hits;		/**< blocks which were read from the cache */
+	guint64 misses;		/**< blocks which were read from the files */
+};
+
+GArray *blockcaches = NULL;	/**< the BLOCK_CACHE of each export which
+				     is open in this process */
+pthread_mutex_t blockcacheslock = PTHREAD_MUTEX_INITIALIZER; /**< protects
+								   blockcaches
+								   and the
+								   refcounts */
+
+/**
+ * Check whether an export may have a block cache. Writes must go
+ * through the cache to keep it up to date, so a writable export may
+ * only have one if all connections are served from this process.
+ * Reads of the io_uring engine don't go through rawexpread_fully(), so
+ * it can't use one either.
+ **/
+static gboolean can_use_block_cache(SERVER *serve) {
+	if(serve->cachesize < CACHEBLOCKSIZE || serve->ioengine == IOENGINE_URING ||
+	   serve->sharedcache)
+		return FALSE;
+	if(serve->flags & (F_READONLY | F_COPYONWRITE))
+		return TRUE;
+	return (glob_flags & F_THREADED) && listeners <= 1;
+}
+
+/**
+ * Get the block cache for a client's export, which was just opened,
+ * creating it if no other connection in this process uses the same
+ * files.
+ *
+ * @return the cache, or NULL if the export doesn't get one
+ **/
+static BLOCK_CACHE *get_block_cache(CLIENT *client) {
+	struct stat stat_buf;
+	BLOCK_CACHE *cache;
+	int i;
+
+	if(!can_use_block_cache(client->server) ||
+	   fstat(g_array_index(client->export, FILE_INFO, 0).fhandle, &stat_buf) < 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&blockcacheslock);
+	if(!blockcaches) {
+		blockcaches = g_array_new(FALSE, FALSE, sizeof(BLOCK_CACHE*));
+	}
+	for(i=0; i<blockcaches->len; i++) {
+		cache = g_array_index(blockcaches, BLOCK_CACHE*, i);
+		if(cache->dev == stat_buf.st_dev && cache->ino == stat_buf.st_ino) {
+			cache->refcount++;
+			pthread_mutex_unlock(&blockcacheslock);
+			return cache;
+		}
+	}
+	cache = g_new0(BLOCK_CACHE, 1);
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->dev = stat_buf.st_dev;
+	cache->ino = stat_buf.st_ino;
+	cache->refcount = 1;
+	cache->blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+	cache->maxblocks = client->server->cachesize / CACHEBLOCKSIZE;
+	cache->maxa1in = cache->maxblocks / 4;
+	cache->maxa1out = cache->maxblocks / 2;
+	g_array_append_val(blockcaches, cache);
+	pthread_mutex_unlock(&blockcacheslock);
+	msg(LOG_INFO, "Caching %d blocks of %s", cache->maxblocks,
+	    client->exportname);
+	return cache;
+}
+
+/**
+ * Callback for g_hash_table_foreach_remove() which frees a block.
+ **/
+static gboolean free_cache_block(gpointer key, gpointer value,
+				 gpointer user_data) {
+	CACHE_BLOCK *block = value;
+
+	g_free(block->data);
+	g_free(block);
+	return TRUE;
+}
+
+/**
+ * Drop a reference to a block cache, freeing it when it was the last
+ * one.
+ **/
+static void put_block_cache(BLOCK_CACHE *cache) {
+	int i;
+
+	if(!cache) {
+		return;
+	}
+	pthread_mutex_lock(&blockcacheslock);
+	if(--cache->refcount > 0) {
+		pthread_mutex_unlock(&blockcacheslock);
+		return;
+	}
+	for(i=0; i<blockcaches->len; i++) {
+		if(g_array_index(blockcaches, BLOCK_CACHE*, i) == cache) {
+			g_array_remove_index_fast(blockcaches, i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&blockcacheslock);
+	g_hash_table_foreach_remove(cache->blocks, free_cache_block, NULL);
+	g_hash_table_destroy(cache->blocks);
+	pthread_mutex_destroy(&cache->lock);
+	g_free(cache);
+}
+
+/**
+ * Take a block off its queue.
+ **/
+static void cache_unlink(BLOCK_CACHE *cache, CACHE_BLOCK *block) {
+	CACHE_LIST *queue = &cache->queues[block->queue];
+
+	if(block->prev)
+		block->prev->next = block->next;
+	else
+		queue->head = block->next;
+	if(block->next)
+		block->next->prev = block->prev;
+	else
+		queue->tail = block->prev;
+	queue->len--;
+}
+
+/**
+ * Put a block at the head of a queue.
+ **/
+static void cache_push(BLOCK_CACHE *cache, CACHE_BLOCK *block,
+		       CACHE_QUEUE q) {
+	CACHE_LIST *queue = &cache->queues[q];
+
+	block->queue = q;
+	block->prev = NULL;
+	block->next = queue->head;
+	if(queue->head)
+		queue->head->prev = block;
+	else
+		queue->tail = block;
+	queue->head = block;
+	queue->len++;
+}
+
+/**
+ * Remove a block from the cache altogether.
+ **/
+static void cache_drop(BLOCK_CACHE *cache, CACHE_BLOCK *block) {
+	cache_unlink(cache, block);
+	g_hash_table_remove(cache->blocks, &block->blknum);
+	g_free(block->data);
+	g_free(block);
+}
+
+/**
+ * Evict a block to make room for another one, as 2Q does it.
+ *
+ * @return the buffer the evicted block used
+ **/
+static char *cache_evict(BLOCK_CACHE *cache) {
+	CACHE_BLOCK *block;
+	char *data;
+
+	if(cache->queues[CACHE_A1IN].len > cache->maxa1in ||
+	   !cache->queues[CACHE_AM].len) {
+		block = cache->queues[CACHE_A1IN].tail;
+		cache_unlink(cache, block);
+		data = block->data;
+		block->data = NULL;
+		cache_push(cache, block, CACHE_A1OUT);
+		while(cache->queues[CACHE_A1OUT].len > cache->maxa1out) {
+			cache_drop(cache, cache->queues[CACHE_A1OUT].tail);
+		}
+	} else {
+		block = cache->queues[CACHE_AM].tail;
+		data = block->data;
+		block->data = NULL;
+		cache_drop(cache, block);
+	}
+	return data;
+}
+
+/**
+ * Add a block which was read from the files to the cache. Must be
+ * called with the lock of the cache held.
+ *
+ * @param data CACHEBLOCKSIZE bytes of data of the block
+ **/
+static void cache_insert(BLOCK_CACHE *cache, gint64 blknum, char *data) {
+	CACHE_BLOCK *block;
+	char *buf;
+
+	block = g_hash_table_lookup(cache->blocks, &blknum);
+	if(block && block->data) {
+		/* another thread was first */
+		return;
+	}
+	if(block) {
+		/* off a1out first, so that making room doesn't drop it */
+		cache_unlink(cache, block);
+	}
+	if(cache->queues[CACHE_A1IN].len + cache->queues[CACHE_AM].len >=
+	   cache->maxblocks) {
+		buf = cache_evict(cache);
+	} else {
+		buf = g_malloc(CACHEBLOCKSIZE);
+	}
+	memcpy(buf, data, CACHEBLOCKSIZE);
+	if(block) {
+		block->data = buf;
+		cache_push(cache, block, CACHE_AM);
+	} else {
+		block = g_new0(CACHE_BLOCK, 1);
+		block->blknum = blknum;
+		block->data = buf;
+		g_hash_table_insert(cache->blocks, &block->blknum, block);
+		cache_push(cache, block, CACHE_A1IN);
+	}
+}
+
+/**
+ * Drop what the block cache of a client's export holds of a range of
+ * the export, after it was written to. This must happen after the
+ * write; see cache_read() for why.
+ *
+ * @param client The client which wrote
+ * @param a The offset where the write started
+ * @param len The length of the write
+ **/
+static void cache_invalidate(CLIENT *client, off_t a, size_t len) {
+	BLOCK_CACHE *cache = client->blockcache;
+	CACHE_BLOCK *block;
+	CACHE_BLOCK *next;
+	gint64 range[2];
+	gint64 blknum;
+	int q;
+
+	if(!cache || !len)
+		return;
+	range[0] = a / CACHEBLOCKSIZE;
+	range[1] = (a + len - 1) / CACHEBLOCKSIZE;
+	pthread_mutex_lock(&cache->lock);
+	cache->generation++;
+	if(range[1] - range[0] < g_hash_table_size(cache->blocks)) {
+		for(blknum = range[0]; blknum <= range[1]; blknum++) {
+			block = g_hash_table_lookup(cache->blocks, &blknum);
+			if(block && block->data)
+				cache_drop(cache, block);
+		}
+	} else {
+		/* a large trim; cheaper to go over the cache */
+		for(q = CACHE_A1IN; q <= CACHE_AM; q++) {
+			for(block = cache->queues[q].head; block; block = next) {
+				next = block->next;
+				if(block->blknum >= range[0] &&
+				   block->blknum <= range[1])
+					cache_drop(cache, block);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Start writeback of what was written to a file of the export once
+ * more than the writeback option of the export is waiting for it.
+ * Otherwise, the kernel may keep gigabytes in the page cache until a
+ * flush request comes in, which then takes as long as it takes to
+ * write them all. Only SYNC_FILE_RANGE_WRITE is used, so this doesn't
+ * wait for the disk, and doesn't make anything durable either: that is
+ * still up to expflush().
+ *
+ * @param client The client we're writing for
+ * @param i The index of the file in the export
+ * @param foffset The offset into the file where the write started
+ * @param len The length of the write
+ **/
+static void pace_writeback(CLIENT *client, int i, off_t foffset, size_t len) {
+#ifdef USE_SYNC_FILE_RANGE
+	FILE_INFO *fi = &g_array_index(client->export, FILE_INFO, i);
+	WRITEBACK *wb = fi->writeback;
+	off_t start, end;
+
+	if(!wb || !len)
+		return;
+	pthread_mutex_lock(&wb->lock);
+	if(!wb->pending || foffset < wb->start)
+		wb->start = foffset;
+	if(!wb->pending || foffset + (off_t)len > wb->end)
+		wb->end = foffset + len;
+	wb->pending += len;
+	if(wb->pending < client->server->writeback) {
+		pthread_mutex_unlock(&wb->lock);
+		return;
+	}
+	start = wb->start;
+	end = wb->end;
+	wb->pending = 0;
+	pthread_mutex_unlock(&wb->lock);
+	DEBUG("Starting writeback of fd %d from %llu to %llu\n", fi->fhandle,
+	      (unsigned long long)start, (unsigned long long)end);
+	sync_file_range(fi->fhandle, start, end - start, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+/**
+ * Write an amount of bytes at a given offset to one file of the export.
+ * Uses positional writes only, so that it may be called from several
+ * threads at once.
+ *
+ * @param fhandle The file to write to
+ * @param foffset The offset into fhandle where the write should start
+ * @param buf The buffer to write from
+ * @param len The length of buf
+ * @param client The client we're serving for
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @return 0 on success, nonzero on failure
+ **/
+int rawexpwrite(int fhandle, off_t foffset, char *buf, size_t len,
+		CLIENT *client, int fua) {
+	ssize_t ret;
+
+	DEBUG("(WRITE to fd %d offset %llu len %u fua %d), ", fhandle, (long long unsigned)foffset, (unsigned int)len, fua);
+
+	while(len > 0) {
+		if(client->server->flags & F_DIRECT)
+			ret = direct_pwrite(client, fhandle, buf, len, foffset);
+		else
+			ret = pwrite(fhandle, buf, len, foffset);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		foffset += ret;
+		buf += ret;
+		len -= ret;
+	}
+	if(client->server->flags & F_SYNC) {
+		return group_sync(fhandle, FALSE);
+	} else if (fua) {
+
+	  /* This is where we would do the following
+	   *   #ifdef USE_SYNC_FILE_RANGE
+	   * However, we don't, for the reasons set out below
+	   * by Christoph Hellwig <hch@infradead.org>
+	   *
+	   * [BEGINS] 
+	   * fdatasync is equivalent to fsync except that it does not flush
+	   * non-essential metadata (basically just timestamps in practice), but it
+	   * does flush metadata requried to find the data again, e.g. allocation
+	   * information and extent maps.  sync_file_range does nothing but flush
+	   * out pagecache content - it means you basically won't get your data
+	   * back in case of a crash if you either:
+	   * 
+	   *  a) have a volatile write cache in your disk (e.g. any normal SATA disk)
+	   *  b) are using a sparse file on a filesystem
+	   *  c) are using a fallocate-preallocated file on a filesystem
+	   *  d) use any file on a COW filesystem like btrfs
+	   * 
+	   * e.g. it only does anything useful for you if you do not have a volatile
+	   * write cache, and either use a raw block device node, or just overwrite
+	   * an already fully allocated (and not preallocated) file on a non-COW
+	   * filesystem.
+	   * [ENDS]
+	   *
+	   * So FUA writes go to a second FD with O_DSYNC set instead, see
+	   * rawexpwrite_fully(); we only get here if that one could not be
+	   * opened.
+	   *
+	   */
+#if 0
+		sync_file_range(fhandle, foffset, len,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+		return group_sync(fhandle, TRUE);
+#endif
+	}
+	return 0;
+}
+
+/**
+ * Write an amount of bytes at a given offset to the right files. This
+ * abstracts the write-side of the multiple file option: the file holding
+ * the start of the range is looked up once, after which the request is
+ * written to it and the files after it with one rawexpwrite() each.
+ *
+ * @param a The offset where the write should start
+ * @param buf The buffer to write from
+ * @param len The length of buf
+ * @param client The client we're serving for
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @return 0 on success, nonzero on failure
+ **/
+int rawexpwrite_fully(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	FILE_INFO fi;
+	off_t start = a;
+	size_t curlen;
+	int i;
+
+	if((i = get_fileidx(client->export, a)) < 0)
+		return -1;
+	for(; len > 0 && i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		curlen = get_segment_len(client->export, i, a, len);
+		if(fua && fi.dsynchandle >= 0) {
+			/* the write itself is synced, and nothing else */
+			if(rawexpwrite(fi.dsynchandle, a - fi.startoff, buf,
+				       curlen, client, 0))
+				goto fail;
+		} else {
+			if(rawexpwrite(fi.fhandle, a - fi.startoff, buf, curlen,
+				       client, fua))
+				goto fail;
+			mark_dirty(client->export, i);
+			pace_writeback(client, i, a - fi.startoff, curlen);
+		}
+		a += curlen;
+		buf += curlen;
+		len -= curlen;
+	}
+	cache_invalidate(client, start, a - start);
+	return len != 0;
+fail:
+	/* part of it may have been written */
+	cache_invalidate(client, start, a - start + curlen);
+	return -1;
+}
+
+/**
+ * Check whether a write request can be moved from the socket to the
+ * export with splice(). This is only possible if the export isn't
+ * copy-on-write (which needs to merge the data with the original page
+ * first) or opened with O_DIRECT (which can't take unaligned data from
+ * a pipe), and if the request doesn't cross the boundary between two
+ * files of a multifile export.
+ *
+ * @param client The client we received the request from
+ * @param a The offset where the write should start
+ * @param len The length of the write
+ * @return TRUE if splice_write() can be used for this request
+ **/
+static gboolean can_splice_write(CLIENT *client, off_t a, size_t len) {
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+
+	if(!(client->server->flags & F_SPLICE) ||
+	   (client->server->flags & (F_COPYONWRITE | F_DIRECT | F_READONLY | F_AUTOREADONLY)))
+		return FALSE;
+	if(get_filepos(client->export, a, &fhandle, &foffset, &maxbytes))
+		return FALSE;
+	return !maxbytes || len <= maxbytes;
+}
+
+/**
+ * Move the data of a write request from the client's socket to the
+ * export, using a pipe and splice() so that it never has to be copied
+ * to userspace. The request must have been checked with
+ * can_splice_write(). All of the data is consumed from the socket,
+ * even if writing to the export fails.
+ *
+ * @param a The offset where the write should start
+ * @param len The length of the write
+ * @param client The client we're writing for
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @return 0 on success, nonzero on failure (with errno set)
+ **/
+int splice_write(off_t a, size_t len, CLIENT *client, int fua) {
+#ifdef HAVE_SPLICE
+	FILE_INFO fi;
+	int fhandle;
+	off_t foffset;
+	ssize_t inpipe;
+	ssize_t ret;
+	int error = 0;
+	int i;
+	char buf[DIFFPAGESIZE];
+
+	if((i = get_fileidx(client->export, a)) < 0)
+		return -1;
+	fi = g_array_index(client->export, FILE_INFO, i);
+	fhandle = fi.fhandle;
+	foffset = a - fi.startoff;
+	if(fua && fi.dsynchandle >= 0) {
+		fhandle = fi.dsynchandle;
+		fua = 0;
+	}
+
+	DEBUG("(SPLICE to fd %d offset %llu len %u fua %d), ", fhandle, (long long unsigned)foffset, (unsigned int)len, fua);
+
+	while(len > 0) {
+		inpipe = splice(client->net, NULL, client->splicepipe[1], NULL,
+				len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(inpipe < 0 && errno == EINTR)
+			continue;
+		if(inpipe <= 0)
+			err("Read failed: %m");
+		len -= inpipe;
+		while(inpipe > 0 && !error) {
+			ret = splice(client->splicepipe[0], NULL, fhandle,
+				     &foffset, inpipe, SPLICE_F_MOVE);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret <= 0) {
+				error = ret ? errno : EIO;
+				break;
+			}
+			inpipe -= ret;
+		}
+		/* If the export refused the data, drain the pipe so that
+		 * the next request starts out with an empty one */
+		while(inpipe > 0) {
+			readit(client->splicepipe[0], buf,
+			       inpipe < sizeof(buf) ? inpipe : sizeof(buf));
+			inpipe -= inpipe < sizeof(buf) ? inpipe : sizeof(buf);
+		}
+	}
+	cache_invalidate(client, a, foffset - (a - fi.startoff));
+	if(error) {
+		errno = error;
+		return -1;
+	}
+	if(fhandle == fi.fhandle) {
+		mark_dirty(client->export, i);
+		pace_writeback(client, i, a - fi.startoff,
+			       foffset - (a - fi.startoff));
+	}
+	if(client->server->flags & F_SYNC) {
+		return group_sync(fhandle, FALSE);
+	} else if (fua) {
+		return group_sync(fhandle, TRUE);
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * Read an amount of bytes at a given offset from one file of the
+ * export. Uses positional reads only, so that it may be called from
+ * several threads at once.
+ *
+ * @param fhandle The file to read from
+ * @param foffset The offset into fhandle where the read should start
+ * @param buf A buffer to read into
+ * @param len The size of buf
+ * @param client The client we're serving for
+ * @return 0 on success, nonzero on failure (including reads past the
+ * end of the file)
+ **/
+int rawexpread(int fhandle, off_t foffset, char *buf, size_t len,
+	       CLIENT *client) {
+	ssize_t ret;
+
+	DEBUG("(READ from fd %d offset %llu len %u), ", fhandle, (long long unsigned int)foffset, (unsigned int)len);
+
+	while(len > 0) {
+		if(client->server->flags & F_DIRECT)
+			ret = direct_pread(client, fhandle, buf, len, foffset);
+		else
+			ret = pread(fhandle, buf, len, foffset);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret == 0)
+			errno = EIO;	/* the file ends before the export does */
+		if(ret <= 0)
+			return -1;
+		foffset += ret;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * Read an amount of bytes at a given offset from the files of the
+ * export, without going through its block cache.
+ *
+ * @return 0 on success, nonzero on failure
+ **/
+static int rawexpread_uncached(off_t a, char *buf, size_t len,
+			       CLIENT *client) {
+	FILE_INFO fi;
+	size_t curlen;
+	int i;
+
+	if((i = get_fileidx(client->export, a)) < 0)
+		return -1;
+	for(; len > 0 && i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		curlen = get_segment_len(client->export, i, a, len);
+		if(rawexpread(fi.fhandle, a - fi.startoff, buf, curlen, client))
+			return -1;
+		a += curlen;
+		buf += curlen;
+		len -= curlen;
+	}
+	return len != 0;
+}
+
+/**
+ * Read an amount of bytes at a given offset of the export through its
+ * block cache. Blocks which aren't in the cache are read from the
+ * files in runs, and added to it, unless the range was written to in
+ * the mean time: then what we read may predate the write, whereas
+ * cache_invalidate() only drops blocks which are in the cache already.
+ *
+ * @return 0 on success, nonzero on failure
+ **/
+static int cache_read(off_t a, char *buf, size_t len, CLIENT *client) {
+	BLOCK_CACHE *cache = client->blockcache;
+	CACHE_BLOCK *block;
+	gint64 blknum = a / CACHEBLOCKSIZE;
+	gint64 last = (a + len - 1) / CACHEBLOCKSIZE;
+	gint64 first;
+	off_t pos = a;
+	off_t start, end;
+	size_t curlen;
+	guint generation;
+	char *runbuf;
+
+	if(a + (off_t)len > client->exportsize)
+		return rawexpread_uncached(a, buf, len, client);
+	while(blknum <= last) {
+		pthread_mutex_lock(&cache->lock);
+		block = g_hash_table_lookup(cache->blocks, &blknum);
+		if(block && block->data) {
+			if(block->queue == CACHE_AM) {
+				cache_unlink(cache, block);
+				cache_push(cache, block, CACHE_AM);
+			}
+			start = pos - blknum * CACHEBLOCKSIZE;
+			curlen = MIN(CACHEBLOCKSIZE - start, a + len - pos);
+			memcpy(buf + (pos - a), block->data + start, curlen);
+			cache->hits++;
+			client->cachehits++;
+			pthread_mutex_unlock(&cache->lock);
+			pos += curlen;
+			blknum++;
+			continue;
+		}
+		first = blknum;
+		do {
+			blknum++;
+			block = g_hash_table_lookup(cache->blocks, &blknum);
+		} while(blknum <= last && !(block && block->data));
+		cache->misses += blknum - first;
+		client->cachemisses += blknum - first;
+		generation = cache->generation;
+		pthread_mutex_unlock(&cache->lock);
+
+		start = first * CACHEBLOCKSIZE;
+		end = MIN(blknum * CACHEBLOCKSIZE, client->exportsize);
+		/* the last block of the export may be a partial one */
+		runbuf = g_malloc0((blknum - first) * CACHEBLOCKSIZE);
+		if(rawexpread_uncached(start, runbuf, end - start, client)) {
+			g_free(runbuf);
+			return -1;
+		}
+		curlen = MIN(end, a + (off_t)len) - pos;
+		memcpy(buf + (pos - a), runbuf + (pos - start), curlen);
+		pos += curlen;
+
+		pthread_mutex_lock(&cache->lock);
+		if(generation == cache->generation) {
+			for(; first < blknum; first++) {
+				cache_insert(cache, first, runbuf +
+					     (first * CACHEBLOCKSIZE - start));
+			}
+		}
+		pthread_mutex_unlock(&cache->lock);
+		g_free(runbuf);
+	}
+	return 0;
+}
+
+/**
+ * What a file of an export was when it was opened, so that we can tell
+ * whether it was replaced or resized since.
+ **/
+typedef struct {
+	dev_t dev;		/**< device the file is on */
+	ino_t ino;		/**< inode of the file */
+	off_t size;		/**< size of the file */
+	struct timespec mtime;	/**< modification time of the file; only of
+				  use for files the server doesn't write */
+} FILE_STAMP;
+
+/**
+ * Record what a file is in a FILE_STAMP
+ **/
+static void stamp_file(FILE_STAMP *stamp, struct stat *stat_buf) {
+	stamp->dev = stat_buf->st_dev;
+	stamp->ino = stat_buf->st_ino;
+	stamp->size = stat_buf->st_size;
+	stamp->mtime = stat_buf->st_mtim;
+}
+
+/**
+ * A block in a shared block cache. Readers don't take a lock: they
+ * check that version was even, and hadn't changed, around reading the
+ * block, the way a seqlock works. A writer makes it odd while it
+ * changes the block.
+ **/
+typedef struct {
+	gint version;		/**< odd while the block is being written */
+	gint epoch;		/**< epoch of the cache the block was read in;
+				  0 for an empty block */
+	gint referenced;	/**< whether the block was read since the
+				  clock hand passed it */
+	gint64 blknum;		/**< number of the block in the export */
+	char data[CACHEBLOCKSIZE]; /**< the data of the block */
+} SHARED_BLOCK;
+
+/**
+ * Blocks of a read-only or copy-on-write export, in memory which is
+ * shared by all processes of the server. The blocks are in sets of
+ * SHARED_CACHE_WAYS; a block can only be in the set its number hashes
+ * to, and replaces the first one in it which wasn't read since the last
+ * time (the clock algorithm).
+ **/
+struct shared_cache {
+	pthread_mutex_t lock;	/**< shared by the processes; protects the
+				  identity of the files below */
+	FILE_STAMP stamp;	/**< the file of the export the blocks were
+				  read from */
+	gint epoch;		/**< incremented whenever the file was found
+				  to have been replaced, resized or
+				  modified, so that blocks of the old one
+				  are no longer used */
+	guint nsets;		/**< number of sets of blocks */
+	SHARED_BLOCK blocks[];	/**< nsets * SHARED_CACHE_WAYS blocks */
+};
+
+/**
+ * Find the set of a shared block cache a block belongs in.
+ **/
+static SHARED_BLOCK *shared_cache_set(SHARED_CACHE *cache, gint64 blknum) {
+	guint64 hash = (guint64)blknum * 0x9E3779B97F4A7C15ULL;
+
+	return &cache->blocks[((hash >> 32) % cache->nsets) * SHARED_CACHE_WAYS];
+}
+
+/**
+ * Copy part of a block from a shared block cache, if it's in there.
+ *
+ * @param offset The offset of the part in the block
+ * @param len The length of the part
+ * @param buf Where to copy it to; may be overwritten even on a miss
+ * @return TRUE on a hit
+ **/
+static gboolean shared_cache_get(SHARED_CACHE *cache, gint epoch,
+				 gint64 blknum, size_t offset, size_t len,
+				 char *buf) {
+	SHARED_BLOCK *block = shared_cache_set(cache, blknum);
+	gint version;
+	int i;
+
+	for(i=0; i<SHARED_CACHE_WAYS; i++, block++) {
+		version = g_atomic_int_get(&block->version);
+		if((version & 1) || block->epoch != epoch ||
+		   block->blknum != blknum) {
+			continue;
+		}
+		memcpy(buf, block->data + offset, len);
+		if(g_atomic_int_get(&block->version) != version) {
+			/* replaced while we were reading it */
+			continue;
+		}
+		if(!g_atomic_int_get(&block->referenced)) {
+			g_atomic_int_set(&block->referenced, 1);
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * Add a block which was read from the files to a shared block cache.
+ * If another process is busy with the block that would have to make
+ * room, the block isn't added; we don't wait for anyone.
+ *
+ * @param data CACHEBLOCKSIZE bytes of data of the block
+ **/
+static void shared_cache_put(SHARED_CACHE *cache, gint epoch, gint64 blknum,
+			     const char *data) {
+	SHARED_BLOCK *set = shared_cache_set(cache, blknum);
+	SHARED_BLOCK *victim = NULL;
+	gint version;
+	int pass;
+	int i;
+
+	for(i=0; i<SHARED_CACHE_WAYS; i++) {
+		if(set[i].epoch == epoch && set[i].blknum == blknum) {
+			return;
+		}
+	}
+	for(pass=0; pass<2 && !victim; pass++) {
+		for(i=0; i<SHARED_CACHE_WAYS; i++) {
+			if(set[i].epoch != epoch ||
+			   !g_atomic_int_get(&set[i].referenced)) {
+				victim = &set[i];
+				break;
+			}
+			/* second chance */
+			g_atomic_int_set(&set[i].referenced, 0);
+		}
+	}
+	if(!victim) {
+		victim = &set[blknum % SHARED_CACHE_WAYS];
+	}
+	version = g_atomic_int_get(&victim->version);
+	if((version & 1) ||
+	   !g_atomic_int_compare_and_exchange(&victim->version, version,
+					      version + 1)) {
+		return;
+	}
+	victim->epoch = epoch;
+	victim->blknum = blknum;
+	memcpy(victim->data, data, CACHEBLOCKSIZE);
+	g_atomic_int_set(&victim->referenced, 0);
+	g_atomic_int_set(&victim->version, version + 2);
+}
+
+/**
+ * Read an amount of bytes at a given offset of the export through the
+ * shared block cache of its server, in the same way as cache_read()
+ * does with a block cache of our own. The files aren't written to, so
+ * there's nothing to invalidate.
+ *
+ * @return 0 on success, nonzero on failure
+ **/
+static int shared_cache_read(off_t a, char *buf, size_t len, CLIENT *client) {
+	SHARED_CACHE *cache = client->server->sharedcache;
+	gint64 blknum = a / CACHEBLOCKSIZE;
+	gint64 last = (a + len - 1) / CACHEBLOCKSIZE;
+	gint64 first;
+	off_t pos = a;
+	off_t start, end;
+	size_t curlen;
+	size_t found;
+	char *runbuf;
+
+	if(a + (off_t)len > client->exportsize)
+		return rawexpread_uncached(a, buf, len, client);
+	while(blknum <= last) {
+		start = pos - blknum * CACHEBLOCKSIZE;
+		curlen = MIN(CACHEBLOCKSIZE - start, a + len - pos);
+		if(shared_cache_get(cache, client->sharedepoch, blknum, start,
+				    curlen, buf + (pos - a))) {
+			client->cachehits++;
+			pos += curlen;
+			blknum++;
+			continue;
+		}
+		/* read up to the next block which is in the cache, which
+		 * is copied as we come across it */
+		first = blknum;
+		found = 0;
+		for(blknum++; blknum <= last; blknum++) {
+			start = blknum * CACHEBLOCKSIZE;
+			curlen = MIN(CACHEBLOCKSIZE, a + len - start);
+			if(shared_cache_get(cache, client->sharedepoch, blknum,
+					    0, curlen, buf + (start - a))) {
+				found = curlen;
+				break;
+			}
+		}
+		client->cachemisses += blknum - first;
+
+		start = first * CACHEBLOCKSIZE;
+		end = MIN(blknum * CACHEBLOCKSIZE, client->exportsize);
+		/* the last block of the export may be a partial one */
+		runbuf = g_malloc0((blknum - first) * CACHEBLOCKSIZE);
+		if(rawexpread_uncached(start, runbuf, end - start, client)) {
+			g_free(runbuf);
+			return -1;
+		}
+		curlen = MIN(end, a + (off_t)len) - pos;
+		memcpy(buf + (pos - a), runbuf + (pos - start), curlen);
+		pos += curlen;
+		for(; first < blknum; first++) {
+			shared_cache_put(cache, client->sharedepoch, first,
+					 runbuf + (first * CACHEBLOCKSIZE - start));
+		}
+		g_free(runbuf);
+		if(found) {
+			client->cachehits++;
+			pos += found;
+			blknum++;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Read an amount of bytes at a given offset from the right files. This
+ * abstracts the read-side of the multiple files option, in the same way
+ * as rawexpwrite_fully() does for writes, and goes through the block
+ * cache of the export if it has one, whether shared or not.
+ *
+ * @return 0 on success, nonzero on failure
+ **/
+int rawexpread_fully(off_t a, char *buf, size_t len, CLIENT *client) {
+	if(client->sharedepoch)
+		return shared_cache_read(a, buf, len, client);
+	if(client->blockcache)
+		return cache_read(a, buf, len, client);
+	return rawexpread_uncached(a, buf, len, client);
+}
+
+/**
+ * The copy-on-write map of a connection: which page of the diff file
+ * holds each page of the export that was written to. It is a radix
+ * tree, like a page table: each level of tables covers COWMAP_BITS
+ * bits of the page number, and the leaves hold the pages of the diff
+ * file. Tables are only allocated for regions which were written to,
+ * so setting up the map costs nothing, whatever the size of the export,
+ * and it takes memory in proportion to what was written.
+ **/
+struct cow_map {
+	void *root;		/**< the top table, or NULL if nothing was
+				     written yet */
+	int levels;		/**< number of levels of tables above the
+				     leaves */
+	size_t tables;		/**< number of tables allocated */
+};
+
+/**
+ * Create an empty copy-on-write map
+ *
+ * @param pages The number of pages of the export
+ * @return the map, or NULL if it couldn't be allocated
+ **/
+static COW_MAP *cowmap_new(off_t pages) {
+	COW_MAP *map;
+
+	if(!(map = calloc(1, sizeof(COW_MAP))))
+		return NULL;
+	while((map->levels + 1) * COWMAP_BITS < sizeof(off_t) * 8 - 1 &&
+	      ((off_t)COWMAP_FANOUT << (map->levels * COWMAP_BITS)) < pages)
+		map->levels++;
+	return map;
+}
+
+/**
+ * Find where a page of the export is in the diff file
+ *
+ * @param map The copy-on-write map
+ * @param page The page of the export
+ * @return the page of the diff file, or COWMAP_ABSENT
+ **/
+static u64 cowmap_get(COW_MAP *map, off_t page) {
+	void **table = map->root;
+	int level;
+
+	for(level = map->levels; level > 0 && table; level--)
+		table = table[(page >> (level * COWMAP_BITS)) & (COWMAP_FANOUT - 1)];
+	if(!table)
+		return COWMAP_ABSENT;
+	return ((u64 *)table)[page & (COWMAP_FANOUT - 1)];
+}
+
+/**
+ * Record where a page of the export is in the diff file, allocating
+ * the tables which lead to it if they aren't there yet
+ *
+ * @param map The copy-on-write map
+ * @param page The page of the export
+ * @param where The page of the diff file
+ * @return 0 on success, -1 if memory ran out
+ **/
+static int cowmap_set(COW_MAP *map, off_t page, u64 where) {
+	void **slot = &map->root;
+	int level;
+
+	for(level = map->levels; level >= 0; level--) {
+		if(!*slot) {
+			if(level) {
+				*slot = calloc(COWMAP_FANOUT, sizeof(void *));
+			} else if((*slot = malloc(COWMAP_FANOUT * sizeof(u64)))) {
+				/* all entries COWMAP_ABSENT */
+				memset(*slot, 0xff, COWMAP_FANOUT * sizeof(u64));
+			}
+			if(!*slot)
+				return -1;
+			map->tables++;
+		}
+		if(level)
+			slot = &((void **)*slot)[(page >> (level * COWMAP_BITS)) & (COWMAP_FANOUT - 1)];
+	}
+	((u64 *)*slot)[page & (COWMAP_FANOUT - 1)] = where;
+	return 0;
+}
+
+/**
+ * Free a table of a copy-on-write map and the tables below it
+ **/
+static void cowmap_free_table(void *table, int level) {
+	int i;
+
+	if(!table)
+		return;
+	if(level) {
+		for(i = 0; i < COWMAP_FANOUT; i++)
+			cowmap_free_table(((void **)table)[i], level - 1);
+	}
+	free(table);
+}
+
+/**
+ * Free a copy-on-write map
+ **/
+static void cowmap_free(COW_MAP *map) {
+	if(!map)
+		return;
+	cowmap_free_table(map->root, map->levels);
+	free(map);
+}
+
+/**
+ * Find how much of a range of a copy-on-write export, from its start,
+ * can be read or written with one system call: either pages which are
+ * all still in the original file, or pages which follow each other in
+ * the diff file as well. Pages which are being copied to the diff file
+ * still read the same from the original file, but a write has to wait
+ * until they are there. Must be called with the client's cowlock held.
+ *
+ * @param client The client whose export it is
+ * @param a The offset where the range starts
+ * @param len The length of the range
+ * @param diffoff Set to where the extent starts in the diff file; to
+ *	-1 if it is in the original file; or, if writing, to -2 if it is
+ *	being copied to the diff file
+ * @param writing Whether the extent is to be written to
+ * @return the length of the extent
+ **/
+static size_t cow_extent(CLIENT *client, off_t a, size_t len, off_t *diffoff,
+			 gboolean writing) {
+	off_t bs = client->server->cowblocksize;
+	off_t first = a / bs;
+	off_t page = first;
+	u64 difpage = cowmap_get(client->difmap, first);
+	u64 next;
+	size_t extent = MIN(len, (size_t)(bs - (a - first * bs)));
+
+	if (difpage == COWMAP_PENDING && !writing)
+		difpage = COWMAP_ABSENT;
+	while (extent < len && difpage != COWMAP_PENDING) {
+		page++;
+		next = cowmap_get(client->difmap, page);
+		if (next == COWMAP_PENDING && !writing)
+			next = COWMAP_ABSENT;
+		if (difpage == COWMAP_ABSENT ? next != COWMAP_ABSENT
+					     : next != difpage + (page - first))
+			break;
+		extent += MIN(len - extent, (size_t)bs);
+	}
+	if (difpage == COWMAP_ABSENT)
+		*diffoff = -1;
+	else if (difpage == COWMAP_PENDING)
+		*diffoff = -2;
+	else
+		*diffoff = (off_t)difpage * bs + (a - first * bs);
+	return extent;
+}
+
+/**
+ * Look up an extent of a copy-on-write export, see cow_extent(), taking
+ * the client's cowlock for it.
+ **/
+static size_t cow_lookup(CLIENT *client, off_t a, size_t len, off_t *diffoff,
+			 gboolean writing) {
+	size_t extent;
+
+	pthread_rwlock_rdlock(&client->cowlock);
+	extent = cow_extent(client, a, len, diffoff, writing);
+	pthread_rwlock_unlock(&client->cowlock);
+	return extent;
+}
+
+/**
+ * Read an amount of bytes at a given offset from the right file. This
+ * abstracts the read-side of the copyonwrite stuff, and calls
+ * rawexpread() with the right parameters to do the actual work.
+ * @param a The offset where the read should start
+ * @param buf A buffer to read into
+ * @param len The size of buf
+ * @param client The client we're going to read for
+ * @return 0 on success, nonzero on failure
+ **/
+int expread(off_t a, char *buf, size_t len, CLIENT *client) {
+	size_t rdlen;
+	off_t diffoff;
+
+	if (!(client->server->flags & F_COPYONWRITE))
+		return(rawexpread_fully(a, buf, len, client));
+	DEBUG("Asked to read %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+
+	while (len > 0) {
+		rdlen=cow_lookup(client, a, len, &diffoff, FALSE);
+		if (diffoff >= 0) { /* the blocks are already there */
+			DEBUG("%u bytes at %llu are at %llu\n", (unsigned int)rdlen,
+			      (unsigned long long)a, (unsigned long long)diffoff);
+			if (pread(client->difffile, buf, rdlen, diffoff) != rdlen)
+				return -1;
+		} else { /* the blocks are not there */
+			DEBUG("%u bytes at %llu are not here, we read the original ones\n",
+			      (unsigned int)rdlen, (unsigned long long)a);
+			if(rawexpread_fully(a, buf, rdlen, client)) return -1;
+		}
+		len-=rdlen; a+=rdlen; buf+=rdlen;
+	}
+	return 0;
+}
+
+/**
+ * Send an amount of bytes at a given offset in a file to the client's
+ * socket. Uses sendfile() so that the data doesn't have to be copied
+ * through userspace, and falls back to pread() and write() if that
+ * isn't possible for this combination of file and socket.
+ *
+ * @param net The socket to send the data to
+ * @param fhandle The file to read the data from
+ * @param foffset The offset in fhandle where the data starts
+ * @param len The number of bytes to send
+ * @return 0 on success, nonzero on failure
+ **/
+static int sendfile_fully(int net, int fhandle, off_t foffset, size_t len) {
+	char buf[DIFFPAGESIZE * 16];
+	ssize_t ret;
+
+#ifdef USE_SENDFILE
+	while(len > 0) {
+		ret = sendfile(net, fhandle, &foffset, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			break;
+		len -= ret;
+	}
+#endif
+	while(len > 0) {
+		ret = pread(fhandle, buf, len < sizeof(buf) ? len : sizeof(buf),
+			    foffset);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		writeit(net, buf, ret);
+		foffset += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * Send an amount of bytes at a given offset from the right file to the
+ * client's socket. This is the zero-copy equivalent of rawexpread_fully().
+ *
+ * @param a The offset where the data starts
+ * @param len The number of bytes to send
+ * @param client The client we're sending to
+ * @return 0 on success, nonzero on failure
+ **/
+int rawexpsend_fully(off_t a, size_t len, CLIENT *client) {
+	FILE_INFO fi;
+	size_t curlen;
+	int i;
+
+	if((i = get_fileidx(client->export, a)) < 0)
+		return -1;
+	for(; len > 0 && i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		curlen = get_segment_len(client->export, i, a, len);
+		DEBUG("(SEND from fd %d offset %llu len %u), ", fi.fhandle, (long long unsigned int)(a - fi.startoff), (unsigned int)curlen);
+		if(sendfile_fully(client->net, fi.fhandle, a - fi.startoff,
+				  curlen))
+			return -1;
+		a += curlen;
+		len -= curlen;
+	}
+	return len != 0;
+}
+
+/**
+ * Send an amount of bytes at a given offset in the export to the
+ * client's socket. This is the zero-copy equivalent of expread(); the
+ * reply header must already have been sent, so a failure here can't
+ * be reported to the client anymore.
+ *
+ * @param a The offset where the data starts
+ * @param len The number of bytes to send
+ * @param client The client we're sending to
+ * @return 0 on success, nonzero on failure
+ **/
+int expsend(off_t a, size_t len, CLIENT *client) {
+	size_t rdlen;
+	off_t diffoff;
+
+	if (!(client->server->flags & F_COPYONWRITE))
+		return rawexpsend_fully(a, len, client);
+	DEBUG("Asked to send %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+
+	while (len > 0) {
+		rdlen=cow_lookup(client, a, len, &diffoff, FALSE);
+		if (diffoff >= 0) {
+			if (sendfile_fully(client->net, client->difffile,
+					   diffoff, rdlen))
+				return -1;
+		} else {
+			if (rawexpsend_fully(a, rdlen, client))
+				return -1;
+		}
+		len-=rdlen; a+=rdlen;
+	}
+	return 0;
+}
+
+/**
+ * Give the kernel advice on a range of the export, with posix_fadvise().
+ *
+ * @param client The client whose export it is
+ * @param a The offset where the range starts
+ * @param len The length of the range
+ * @param advice The POSIX_FADV_* advice
+ **/
+static void expfadvise(CLIENT *client, off_t a, off_t len, int advice) {
+#ifdef HAVE_POSIX_FADVISE
+	FILE_INFO fi;
+	size_t curlen;
+	int i;
+
+	if((i = get_fileidx(client->export, a)) < 0)
+		return;
+	for(; len > 0 && i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		curlen = get_segment_len(client->export, i, a, len);
+		posix_fadvise(fi.fhandle, a - fi.startoff, curlen, advice);
+		a += curlen;
+		len -= curlen;
+	}
+#endif
+}
+
+/**
+ * Read ahead of a stream. We keep a window ahead of the client in the
+ * page cache, which starts at READAHEAD_MIN and doubles each time the
+ * client has used up half of it, up to the readahead option of the
+ * export.
+ *
+ * @param client The client which reads
+ * @param end Where the last read of the stream ends
+ **/
+static void stream_readahead(CLIENT *client, off_t end) {
+	off_t from;
+
+	if(!client->server->readahead)
+		return;
+	if(client->rawindow && client->raend - end >= client->rawindow / 2)
+		return;
+	if(!client->rawindow)
+		client->rawindow = MIN(READAHEAD_MIN, client->server->readahead);
+	else
+		client->rawindow = MIN(client->rawindow * 2, client->server->readahead);
+	from = MAX(client->raend, end);
+	client->raend = MIN(end + client->rawindow, client->exportsize);
+	if(from < client->raend) {
+		DEBUG("Reading ahead from %llu to %llu\n", (unsigned long long)from,
+		      (unsigned long long)client->raend);
+		expfadvise(client, from, client->raend - from,
+			   POSIX_FADV_WILLNEED);
+	}
+}
+
+/**
+ * Drop what a stream read from the page cache, so that one-shot
+ * traffic such as a backup doesn't evict the data other clients use.
+ * With fadvise = noreuse, that's done for every stream; with
+ * fadvise = auto, once it has read DROPBEHIND_MIN bytes. We stay a
+ * DROPBEHIND_CHUNK behind the client, so that reads which are still
+ * in flight keep their pages.
+ *
+ * @param client The client which reads
+ * @param a Where the last read of the stream starts
+ **/
+static void stream_dropbehind(CLIENT *client, off_t a) {
+	off_t to = a - DROPBEHIND_CHUNK;
+
+	switch(client->server->fadvise) {
+	case FADVISE_NOREUSE:
+		break;
+	case FADVISE_AUTO:
+		if(a - client->rastart >= DROPBEHIND_MIN)
+			break;
+		/* fallthrough */
+	default:
+		return;
+	}
+	if(to - client->radropped < DROPBEHIND_CHUNK)
+		return;
+	DEBUG("Dropping from %llu to %llu\n", (unsigned long long)client->radropped,
+	      (unsigned long long)to);
+	expfadvise(client, client->radropped, to - client->radropped,
+		   POSIX_FADV_DONTNEED);
+	client->radropped = to;
+}
+
+/**
+ * Follow the reads of a client, to find out whether it reads the
+ * export sequentially. Once READAHEAD_RUN reads in a row each started
+ * where the one before ended, the client is streaming: we read ahead
+ * of it, and drop behind it, as configured. A read elsewhere ends the
+ * stream, until a new one is seen.
+ *
+ * This is done in mainloop(), before a request is handed to I/O
+ * threads or io_uring, which may do the reads out of order and so
+ * hide the pattern from the kernel's own read-ahead. O_DIRECT exports
+ * bypass the page cache, and gain nothing from it.
+ *
+ * @param client The client which reads
+ * @param a The offset of the read
+ * @param len The length of the read
+ **/
+static void follow_stream(CLIENT *client, off_t a, size_t len) {
+	off_t end = a + len;
+
+	if(client->server->flags & F_DIRECT)
+		return;
+	if(!client->server->readahead &&
+	   client->server->fadvise != FADVISE_NOREUSE &&
+	   client->server->fadvise != FADVISE_AUTO)
+		return;
+	if(a != client->ranext) {
+		if(client->rarun >= READAHEAD_RUN)
+			DEBUG("End of stream at %llu\n", (unsigned long long)client->ranext);
+		client->ranext = end;
+		client->rarun = 1;
+		client->rawindow = 0;
+		client->raend = 0;
+		client->rastart = a;
+		client->radropped = a;
+		return;
+	}
+	client->ranext = end;
+	if(client->rarun < READAHEAD_RUN && ++client->rarun < READAHEAD_RUN)
+		return;
+	stream_readahead(client, end);
+	stream_dropbehind(client, a);
+}
+
+/**
+ * Tell the kernel how the files of an export will be accessed, as set
+ * with the fadvise option. The advice sticks to the file descriptors,
+ * so it holds for every connection which shares them.
+ *
+ * @param client The client whose export was just opened
+ **/
+static void advise_export(CLIENT *client) {
+#ifdef HAVE_POSIX_FADVISE
+	FILE_INFO fi;
+	int advice;
+	int i;
+
+	switch(client->server->fadvise) {
+	case FADVISE_RANDOM:
+		advice = POSIX_FADV_RANDOM;
+		break;
+	case FADVISE_SEQUENTIAL:
+		advice = POSIX_FADV_SEQUENTIAL;
+		break;
+	case FADVISE_NOREUSE:
+		advice = POSIX_FADV_NOREUSE;
+		break;
+	default:
+		return;
+	}
+	for(i=0; i<client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		if(posix_fadvise(fi.fhandle, 0, 0, advice)) {
+			msg(LOG_INFO, "Could not give access advice on file %d of export", i);
+		}
+	}
+#endif
+}
+
+/**
+ * Check whether a read request can be answered with expsend() rather
+ * than going through a buffer with expread(). That isn't the case for
+ * O_DIRECT exports, since sendfile() reads through the page cache, or
+ * for exports with a block cache, which expread() reads through.
+ * Since the reply header goes out before the data, the range must also
+ * lie within the files it is read from, as they were when they were
+ * opened; otherwise expread() has to find out, so that the error can
+ * still be sent to the client. Writes beyond the end of a file only
+ * move reads of that part back to expread().
+ *
+ * @param client The client we're sending to
+ * @param a The offset where the data starts
+ * @param len The number of bytes to send
+ **/
+static gboolean can_send_zerocopy(CLIENT *client, off_t a, size_t len) {
+#ifdef USE_SENDFILE
+	FILE_INFO fi;
+	size_t curlen;
+	int i;
+
+	if((client->server->flags & F_DIRECT) || client->blockcache ||
+	   client->sharedepoch)
+		return FALSE;
+	if((i = get_fileidx(client->export, a)) < 0)
+		return FALSE;
+	for(; len > 0 && i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		curlen = get_segment_len(client->export, i, a, len);
+		if(a - fi.startoff + (off_t)curlen > fi.size)
+			return FALSE;
+		a += curlen;
+		len -= curlen;
+	}
+	return len == 0;
+#else
+	return FALSE;
+#endif
+}
+
+/**
+ * Write a vector of buffers to a file at a given offset, all of it.
+ *
+ * @return 0 on success, -1 on failure
+ **/
+static int pwritev_fully(int fd, struct iovec *iov, int cnt, off_t offset) {
+	ssize_t ret;
+
+	while(cnt > 0) {
+#ifdef HAVE_PWRITEV
+		ret = pwritev(fd, iov, cnt, offset);
+#else
+		ret = pwrite(fd, iov->iov_base, iov->iov_len, offset);
+#endif
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		offset += ret;
+		while(cnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if(cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Copy a range of the original files of a copy-on-write export to the
+ * diff file without passing it through userspace: by sharing the
+ * blocks with FICLONERANGE on filesystems with reflinks, or else with
+ * copy_file_range(), which lets the filesystem copy it.
+ *
+ * @param client The client whose export it is
+ * @param a The offset of the range in the export
+ * @param len The length of the range
+ * @param diffoff Where to copy the range to in the diff file
+ * @return 0 on success, -1 if the range couldn't be copied this way
+ **/
+static int cow_kernelcopy(CLIENT *client, off_t a, off_t len, off_t diffoff) {
+#ifdef HAVE_COPY_FILE_RANGE
+	FILE_INFO fi;
+	size_t curlen;
+	off_t foffset;
+	ssize_t ret;
+	int i;
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+#endif
+
+	if((i = get_fileidx(client->export, a)) < 0)
+		return -1;
+	for(; len > 0 && i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		curlen = get_segment_len(client->export, i, a, len);
+		foffset = a - fi.startoff;
+		DEBUG("(COPY from fd %d offset %llu len %u to offset %llu), ", fi.fhandle, (long long unsigned int)foffset, (unsigned int)curlen, (long long unsigned int)diffoff);
+#ifdef FICLONERANGE
+		range.src_fd = fi.fhandle;
+		range.src_offset = foffset;
+		range.src_length = curlen;
+		range.dest_offset = diffoff;
+		if(ioctl(client->difffile, FICLONERANGE, &range) == 0) {
+			a += curlen;
+			len -= curlen;
+			diffoff += curlen;
+			continue;
+		}
+#endif
+		while(curlen > 0) {
+			ret = copy_file_range(fi.fhandle, &foffset,
+					      client->difffile, &diffoff,
+					      curlen, 0);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret <= 0)
+				return -1;
+			curlen -= ret;
+			a += ret;
+			len -= ret;
+		}
+	}
+	return len != 0 ? -1 : 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * Claim new, consecutive pages of the diff file for pages of a
+ * copy-on-write export which aren't in it yet, and mark those as being
+ * copied there, so that writes to them wait for cow_copyup(). Must be
+ * called with the client's cowlock held for writing.
+ *
+ * @param client The client whose export it is
+ * @param first The first page of the export
+ * @param last The last page of the export
+ * @param difpage Set to the first page claimed in the diff file
+ * @return 0 on success, -1 if memory ran out
+ **/
+static int cow_claim(CLIENT *client, off_t first, off_t last, u64 *difpage) {
+	off_t page;
+
+	for (page = first; page <= last; page++) {
+		if (cowmap_set(client->difmap, page, COWMAP_PENDING)) {
+			while (--page >= first)
+				cowmap_set(client->difmap, page, COWMAP_ABSENT);
+			return -1;
+		}
+	}
+	*difpage = (client->server->flags & F_SPARSE) ? (u64)first : client->difffilelen;
+	if (!(client->server->flags & F_SPARSE))
+		client->difffilelen += last - first + 1;
+	return 0;
+}
+
+/**
+ * Record where pages of a copy-on-write export which were claimed with
+ * cow_claim() are in the diff file, once they were copied there, or
+ * that they still aren't, if that failed; then wake up the writes which
+ * wait for them.
+ *
+ * @param client The client whose export it is
+ * @param first The first page of the export
+ * @param last The last page of the export
+ * @param difpage The first page claimed in the diff file, or
+ *	COWMAP_ABSENT if the copy failed
+ **/
+static void cow_release(CLIENT *client, off_t first, off_t last, u64 difpage) {
+	off_t page;
+
+	pthread_rwlock_wrlock(&client->cowlock);
+	/* the tables were allocated by cow_claim() */
+	for (page = first; page <= last; page++)
+		cowmap_set(client->difmap, page, difpage == COWMAP_ABSENT ?
+			   COWMAP_ABSENT : difpage + (page - first));
+	pthread_rwlock_unlock(&client->cowlock);
+	pthread_mutex_lock(&client->cowwaitlock);
+	pthread_cond_broadcast(&client->cowdone);
+	pthread_mutex_unlock(&client->cowwaitlock);
+}
+
+/**
+ * Wait until a page of a copy-on-write export, which another write is
+ * copying to the diff file, is there.
+ *
+ * @param client The client whose export it is
+ * @param a An offset in the page
+ **/
+static void cow_wait(CLIENT *client, off_t a) {
+	u64 difpage;
+
+	pthread_mutex_lock(&client->cowwaitlock);
+	for (;;) {
+		pthread_rwlock_rdlock(&client->cowlock);
+		difpage = cowmap_get(client->difmap, a / client->server->cowblocksize);
+		pthread_rwlock_unlock(&client->cowlock);
+		if (difpage != COWMAP_PENDING)
+			break;
+		pthread_cond_wait(&client->cowdone, &client->cowwaitlock);
+	}
+	pthread_mutex_unlock(&client->cowwaitlock);
+}
+
+/**
+ * Copy pages of a copy-on-write export, which were claimed with
+ * cow_claim(), to the diff file, with a write over them. Only the parts
+ * of the first and last page which the write doesn't cover are read
+ * from the original file; the pages in between are written straight
+ * from the client's buffer, with the edges, in one pwritev().
+ *
+ * @param client The client whose export it is
+ * @param difffile The descriptor of the diff file to write to
+ * @param a The offset where the write starts
+ * @param buf The data to write
+ * @param len The length of the write
+ * @param difpage The first page claimed in the diff file
+ * @return 0 on success, -1 on failure
+ **/
+static int cow_copyup(CLIENT *client, int difffile, off_t a, char *buf,
+		      size_t len, u64 difpage) {
+	off_t bs = client->server->cowblocksize;
+	off_t first = a / bs;
+	off_t last = (a + len - 1) / bs;
+	off_t start = first * bs;
+	/* the last page may end with the export */
+	off_t end = MIN((last + 1) * bs, client->exportsize);
+	char *edges = NULL;
+	struct iovec iov[3];
+	int cnt = 0;
+	int ret = -1;
+
+	DEBUG("Pages %llu to %llu are not here, we put them at %llu\n",
+	      (unsigned long long)first, (unsigned long long)last,
+	      (unsigned long long)difpage);
+	if (a == start && a + (off_t)len == end) {
+		/* nothing of the original pages is left */
+		return pwrite(difffile, buf, len, (off_t)difpage * bs) != len ? -1 : 0;
+	}
+	/* Copying the edge pages in the kernel and then writing over
+	 * them leaves data which only O_DSYNC made durable, so FUA
+	 * writes go through userspace */
+	if (!client->nokernelcopy && difffile == client->difffile) {
+		if ((a == start ||
+		     !cow_kernelcopy(client, start, MIN(bs, end - start),
+				     (off_t)difpage * bs)) &&
+		    (a + (off_t)len == end || (last == first && a > start) ||
+		     !cow_kernelcopy(client, last * bs, end - last * bs,
+				     (off_t)(difpage + (last - first)) * bs))) {
+			return pwrite(difffile, buf, len,
+				      (off_t)difpage * bs + (a - start)) != len ? -1 : 0;
+		}
+		msg(LOG_INFO, "Could not copy to the diff file in the kernel (%s); copying through userspace", strerror(errno));
+		client->nokernelcopy = TRUE;
+	}
+	if ((edges = malloc(2 * bs)) == NULL)
+		return -1;
+	if (a > start) {
+		if (rawexpread_fully(start, edges, a - start, client))
+			goto out;
+		iov[cnt].iov_base = edges;
+		iov[cnt++].iov_len = a - start;
+	}
+	iov[cnt].iov_base = buf;
+	iov[cnt++].iov_len = len;
+	if (a + (off_t)len < end) {
+		if (rawexpread_fully(a + len, edges + bs, end - (a + len), client))
+			goto out;
+		iov[cnt].iov_base = edges + bs;
+		iov[cnt++].iov_len = end - (a + len);
+	}
+	ret = pwritev_fully(difffile, iov, cnt, (off_t)difpage * bs);
+out:
+	free(edges);
+	return ret;
+}
+
+/**
+ * Write an amount of bytes at a given offset to the right file. This
+ * abstracts the write-side of the copyonwrite option, and calls
+ * rawexpwrite() with the right parameters to do the actual work.
+ *
+ * @param a The offset where the write should start
+ * @param buf The buffer to write from
+ * @param len The length of buf
+ * @param client The client we're going to write for.
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @return 0 on success, nonzero on failure
+ **/
+int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	off_t bs = client->server->cowblocksize;
+	off_t first, last;
+	size_t wrlen;
+	off_t diffoff;
+	u64 difpage;
+	int difffile;
+	int ret;
+
+	if (!(client->server->flags & F_COPYONWRITE))
+		return(rawexpwrite_fully(a, buf, len, client, fua)); 
+	DEBUG("Asked to write %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+
+	difffile = client->difffile;
+	if (fua && client->difffiledsync >= 0) {
+		difffile = client->difffiledsync;
+		fua = 0;
+	}
+
+	while (len > 0) {
+		wrlen=cow_lookup(client, a, len, &diffoff, TRUE);
+		if (diffoff == -2) { /* another write is copying them */
+			cow_wait(client, a);
+			continue;
+		}
+		if (diffoff == -1) { /* the blocks are not there */
+			pthread_rwlock_wrlock(&client->cowlock);
+			/* unless another write got to them first */
+			wrlen=cow_extent(client, a, len, &diffoff, TRUE);
+			if (diffoff != -1) {
+				pthread_rwlock_unlock(&client->cowlock);
+				continue;
+			}
+			first=a/bs; last=(a+wrlen-1)/bs;
+			ret=cow_claim(client, first, last, &difpage);
+			pthread_rwlock_unlock(&client->cowlock);
+			if (ret)
+				return -1;
+			ret=cow_copyup(client, difffile, a, buf, wrlen, difpage);
+			cow_release(client, first, last, ret ? COWMAP_ABSENT : difpage);
+			if (ret)
+				return -1;
+		} else { /* the blocks are already there */
+			DEBUG("%u bytes at %llu are at %llu\n", (unsigned int)wrlen,
+			      (unsigned long long)a, (unsigned long long)diffoff);
+			if (pwrite(difffile, buf, wrlen, diffoff) != wrlen)
+				return -1;
+		}
+		len-=wrlen ; a+=wrlen ; buf+=wrlen ;
+	}
+	if (client->server->flags & F_SYNC) {
+		return group_sync(client->difffile, FALSE);
+	} else if (fua) {
+		/* open question: would it be cheaper to do multiple sync_file_ranges?
+		   as we iterate through the above?
+		 */
+		return group_sync(client->difffile, TRUE);
+	}
+	return 0;
+}
+
+/**
+ * Flush data to a client. Only the files which were changed since they
+ * were last synced for a flush are synced.
+ *
+ * @param client The client we're going to write for.
+ * @param a The offset where the range to flush starts
+ * @param len The length of that range, or 0 to flush the whole export
+ * @return 0 on success, nonzero on failure
+ **/
+int expflush(CLIENT *client, off_t a, size_t len) {
+	FILE_INFO *fi;
+	gint dirty;
+	gint i = 0;
 
         if (client->server->flags & F_COPYONWRITE) {
-		return fsync(client->difffile);
+		return group_sync(client->difffile, FALSE);
 	}
-	
-	for (i = 0; i < client->export->len; i++) {
-		FILE_INFO fi = g_array_index(client->export, FILE_INFO, i);
-		if (fsync(fi.fhandle) < 0)
+
+	if (len && (i = get_fileidx(client->export, a)) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (; i < client->export->len; i++) {
+		fi = &g_array_index(client->export, FILE_INFO, i);
+		if (len && fi->startoff >= a + (off_t)len)
+			break;
+		dirty = g_atomic_int_get(&fi->dirty);
+		if (dirty == g_atomic_int_get(&fi->clean))
+			continue;
+		if (group_sync(fi->fhandle, FALSE) < 0)
 			return -1;
+		mark_clean(fi, dirty);
 	}
 	
 	return 0;
@@ -1512,23 +3726,34 @@ int expflush(CLIENT *client) {
  */
 int exptrim(struct nbd_request* req, CLIENT* client) {
 #if HAVE_FALLOC_PH
-	FILE_INFO prev = g_array_index(client->export, FILE_INFO, 0);
-	FILE_INFO cur = prev;
-	int i = 1;
+	FILE_INFO fi;
+	off_t a = req->from;
+	size_t len = ntohl(req->len);
+	size_t curlen;
+	int i;
+
+	/* Punching holes in the base of a copy-on-write export would
+	 * change what every other client sees, and a read-only export
+	 * must not be modified at all */
+	if(client->server->flags & (F_COPYONWRITE | F_READONLY | F_AUTOREADONLY)) {
+		DEBUG("Ignoring TRIM request on read-only or copy-on-write export");
+		return 0;
+	}
+
 	/* We're running on a system that supports the
 	 * FALLOC_FL_PUNCH_HOLE option to re-sparsify a file */
-	do {
-		if(i<client->export->len) {
-			cur = g_array_index(client->export, FILE_INFO, i);
-		}
-		if(prev.startoff <= req->from) {
-			off_t curoff = req->from - prev.startoff;
-			off_t curlen = cur.startoff - prev.startoff - curoff;
-			fallocate(prev.fhandle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, curoff, curlen);
-		}
-		prev = cur;
-	} while(i < client->export->len && cur.startoff < (req->from + req->len));
-	DEBUG("Performed TRIM request from %llu to %llu", (unsigned long long) req->from, (unsigned long long) req->len);
+	if((i = get_fileidx(client->export, a)) < 0)
+		return 0;
+	for(; len > 0 && i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		curlen = get_segment_len(client->export, i, a, len);
+		fallocate(fi.fhandle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, a - fi.startoff, curlen);
+		mark_dirty(client->export, i);
+		a += curlen;
+		len -= curlen;
+	}
+	cache_invalidate(client, req->from, a - req->from);
+	DEBUG("Performed TRIM request from %llu to %llu", (unsigned long long) req->from, (unsigned long long) (req->from + ntohl(req->len)));
 #else
 	DEBUG("Ignoring TRIM request (not supported on current platform");
 #endif
@@ -1703,7 +3928,7 @@ CLIENT* negotiate(int net, CLIENT *client, GArray* servers, int phase) {
 	if (client->server->flags & F_READONLY)
 		flags |= NBD_FLAG_READ_ONLY;
 	if (client->server->flags & F_FLUSH)
-		flags |= NBD_FLAG_SEND_FLUSH;
+		flags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_RANGED_FLUSH;
 	if (client->server->flags & F_FUA)
 		flags |= NBD_FLAG_SEND_FUA;
 	if (client->server->flags & F_ROTATIONAL)
@@ -1730,11 +3955,667 @@ CLIENT* negotiate(int net, CLIENT *client, GArray* servers, int phase) {
 }
 
 /** sending macro. */
-#define SEND(net,reply) { writeit( net, &reply, sizeof( reply )); \
+#define SEND(net,reply) { pthread_mutex_lock(&client->sendlock); \
+	writeit( net, &reply, sizeof( reply )); \
 	if (client->transactionlogfd != -1) \
-		writeit(client->transactionlogfd, &reply, sizeof(reply)); }
+		writeit(client->transactionlogfd, &reply, sizeof(reply)); \
+	pthread_mutex_unlock(&client->sendlock); }
 /** error macro. */
 #define ERROR(client,reply,errcode) { reply.error = htonl(errcode); SEND(client->net,reply); reply.error = 0; }
+
+/**
+ * Wait until a client has at most a given number of requests queued to
+ * its I/O threads.
+ *
+ * @param client The client whose requests we're waiting for
+ * @param max The number of requests that may remain in flight; 0 waits
+ * until all outstanding requests have been replied to
+ **/
+static void async_wait(CLIENT *client, int max) {
+	if(!client->pool)
+		return;
+	pthread_mutex_lock(&client->lock);
+	while(client->inflight > max) {
+		pthread_cond_wait(&client->idle, &client->lock);
+	}
+	pthread_mutex_unlock(&client->lock);
+}
+
+/**
+ * Handle a request in one of the I/O threads of a client, and send the
+ * reply as soon as it is done. Called by the GThreadPool.
+ *
+ * @param data The ASYNC_REQ to handle; freed when done
+ * @param user_data The client the request was received from
+ **/
+static void handle_async_request(gpointer data, gpointer user_data) {
+	ASYNC_REQ *req = data;
+	CLIENT *client = user_data;
+	struct nbd_reply reply;
+	uint16_t command = req->request.type & NBD_CMD_MASK_COMMAND;
+	int error = 0;
+
+	reply.magic = htonl(NBD_REPLY_MAGIC);
+	memcpy(reply.handle, req->request.handle, sizeof(reply.handle));
+	switch(command) {
+	case NBD_CMD_READ:
+		if(expread(req->request.from, req->buf, req->len, client)) {
+			DEBUG("Read failed: %m");
+			error = errno;
+		}
+		break;
+	case NBD_CMD_WRITE:
+		if(expwrite(req->request.from, req->buf, req->len, client,
+			    req->request.type & NBD_CMD_FLAG_FUA)) {
+			DEBUG("Write failed: %m");
+			error = errno;
+		}
+		break;
+	case NBD_CMD_TRIM:
+		if(exptrim(&(req->request), client)) {
+			DEBUG("Trim failed: %m");
+			error = errno;
+		}
+		break;
+	}
+	reply.error = htonl(error);
+
+	pthread_mutex_lock(&client->sendlock);
+	writeit(client->net, &reply, sizeof(reply));
+	if (client->transactionlogfd != -1)
+		writeit(client->transactionlogfd, &reply, sizeof(reply));
+	if (command == NBD_CMD_READ && !error)
+		writeit(client->net, req->buf, req->len);
+	pthread_mutex_unlock(&client->sendlock);
+
+	put_buffer(client, req->buf);
+	g_free(req);
+
+	pthread_mutex_lock(&client->lock);
+	client->inflight--;
+	pthread_cond_broadcast(&client->idle);
+	pthread_mutex_unlock(&client->lock);
+}
+
+/**
+ * Hand a request over to the I/O threads of a client. For a write
+ * request, the data is read from the socket first.
+ *
+ * @param client The client we received the request from
+ * @param request The request, as read by mainloop()
+ * @param len The length of the request, in host order
+ **/
+static void queue_async_request(CLIENT *client, struct nbd_request *request,
+				size_t len) {
+	ASYNC_REQ *req = g_new0(ASYNC_REQ, 1);
+	uint16_t command = request->type & NBD_CMD_MASK_COMMAND;
+
+	memcpy(&(req->request), request, sizeof(struct nbd_request));
+	req->len = len;
+	if(command == NBD_CMD_WRITE || command == NBD_CMD_READ) {
+		req->buf = get_buffer(client, len);
+	}
+	if(command == NBD_CMD_WRITE) {
+		DEBUG("wr: net->buf, ");
+		readit(client->net, req->buf, len);
+	}
+
+	async_wait(client, ASYNC_MAX_INFLIGHT - 1);
+	pthread_mutex_lock(&client->lock);
+	client->inflight++;
+	pthread_mutex_unlock(&client->lock);
+	g_thread_pool_push(client->pool, req, NULL);
+}
+
+/**
+ * Check whether a request can be handed over to the I/O threads.
+ * Flushes and disconnects must see every earlier request completed,
+ * writes to a read-only export are refused straight away, and requests
+ * which don't fit in a single buffer are split up synchronously. The
+ * I/O threads always read into a buffer, so that sendlock is only held
+ * while the reply is written to the socket, never while waiting for
+ * the disk; zero-copy reads are left to mainloop().
+ **/
+static gboolean can_queue_async(CLIENT *client, uint16_t command, size_t len) {
+	if(!client->pool)
+		return FALSE;
+	switch(command) {
+	case NBD_CMD_WRITE:
+		if ((client->server->flags & F_READONLY) ||
+		    (client->server->flags & F_AUTOREADONLY))
+			return FALSE;
+		return len <= BUFSIZE - sizeof(struct nbd_reply);
+	case NBD_CMD_READ:
+		return len <= BUFSIZE - sizeof(struct nbd_reply);
+	case NBD_CMD_TRIM:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+#ifdef HAVE_LIBURING
+typedef struct uring_req URING_REQ;
+
+/**
+ * One operation on the io_uring of a client. A request needs more than
+ * one of these if it crosses the boundary between two files of a
+ * multifile export, or if it has to be synced for FUA.
+ **/
+typedef struct {
+	URING_REQ *req;		/**< the request this operation is part of */
+	uint8_t opcode;		/**< IORING_OP_READ, _WRITE, _FSYNC or
+				     _FALLOCATE */
+	int fileidx;		/**< registered file index: that of the file in
+				     client->export, plus the number of files
+				     for its O_DSYNC descriptor */
+	off_t foffset;		/**< offset into that file; for the sync of a
+				     flush, what the dirty count of the file
+				     was when it was queued */
+	char *buf;		/**< where the data goes to or comes from */
+	size_t len;		/**< number of bytes still to be handled */
+	int flags;		/**< flags for fsync or mode for fallocate */
+} URING_OP;
+
+/**
+ * A request which is being handled by the io_uring engine
+ **/
+struct uring_req {
+	struct nbd_reply reply;	/**< the reply, with the handle filled in */
+	uint16_t command;	/**< the command of the request */
+	int fua;		/**< whether NBD_CMD_FLAG_FUA was set */
+	size_t len;		/**< length of the request */
+	char *data;		/**< the data read or to be written */
+	int buf;		/**< index of the registered buffer data points
+				     to, or -1 if it was allocated separately */
+	int pending;		/**< number of operations still on the ring */
+	int error;		/**< errno of the first operation which failed */
+	int firstfile;		/**< first file written to */
+	int lastfile;		/**< last file written to */
+	gboolean synced;	/**< whether the sync for FUA has been queued,
+				     or isn't needed since the data went to
+				     O_DSYNC descriptors */
+};
+
+/**
+ * The io_uring engine of a client. It is only ever used from the thread
+ * running mainloop().
+ **/
+struct uring_engine {
+	struct io_uring ring;	/**< the ring itself */
+	char *bufs;		/**< URING_DEPTH registered buffers of
+				     URING_BUFSIZE bytes each */
+	int freebufs[URING_DEPTH]; /**< stack of unused buffers */
+	int nfree;		/**< number of entries on freebufs */
+	int inflight;		/**< number of requests on the ring */
+};
+
+static void uring_reap(CLIENT *client, gboolean wait);
+
+/**
+ * Put an operation on the ring. If the submission queue is full, submit
+ * what's on it first.
+ **/
+static void uring_submit_op(CLIENT *client, URING_OP *op) {
+	struct io_uring_sqe *sqe;
+	URING_REQ *req = op->req;
+
+	while(!(sqe = io_uring_get_sqe(&client->uring->ring))) {
+		if(io_uring_submit(&client->uring->ring) <= 0)
+			uring_reap(client, TRUE);
+	}
+	switch(op->opcode) {
+	case IORING_OP_READ:
+		if(req->buf >= 0)
+			io_uring_prep_read_fixed(sqe, op->fileidx, op->buf,
+						 op->len, op->foffset, req->buf);
+		else
+			io_uring_prep_read(sqe, op->fileidx, op->buf, op->len,
+					   op->foffset);
+		break;
+	case IORING_OP_WRITE:
+		if(req->buf >= 0)
+			io_uring_prep_write_fixed(sqe, op->fileidx, op->buf,
+						  op->len, op->foffset, req->buf);
+		else
+			io_uring_prep_write(sqe, op->fileidx, op->buf, op->len,
+					    op->foffset);
+		break;
+	case IORING_OP_FSYNC:
+		io_uring_prep_fsync(sqe, op->fileidx, op->flags);
+		break;
+	case IORING_OP_FALLOCATE:
+		io_uring_prep_fallocate(sqe, op->fileidx, op->flags,
+					op->foffset, op->len);
+		break;
+	}
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+/**
+ * Add an operation to a request and put it on the ring.
+ **/
+static void uring_add_op(CLIENT *client, URING_REQ *req, uint8_t opcode,
+			 int fileidx, off_t foffset, char *buf, size_t len,
+			 int flags) {
+	URING_OP *op = g_new0(URING_OP, 1);
+
+	op->req = req;
+	op->opcode = opcode;
+	op->fileidx = fileidx;
+	op->foffset = foffset;
+	op->buf = buf;
+	op->len = len;
+	op->flags = flags;
+	req->pending++;
+	uring_submit_op(client, op);
+}
+
+/**
+ * Called when the last operation of a request has completed. Syncs the
+ * data first if the request needs that, and sends the reply otherwise.
+ **/
+static void uring_finish_req(CLIENT *client, URING_REQ *req) {
+	URING_ENGINE *engine = client->uring;
+	int i;
+
+	if(req->command == NBD_CMD_WRITE && !req->error && !req->synced &&
+	   (req->fua || (client->server->flags & F_SYNC))) {
+		req->synced = TRUE;
+		req->pending++;
+		for(i = req->firstfile; i <= req->lastfile; i++) {
+			uring_add_op(client, req, IORING_OP_FSYNC, i, 0, NULL, 0,
+				     (client->server->flags & F_SYNC) ?
+				     0 : IORING_FSYNC_DATASYNC);
+		}
+		if(--req->pending)
+			return;
+	}
+
+	req->reply.error = htonl(req->error);
+	pthread_mutex_lock(&client->sendlock);
+	writeit(client->net, &req->reply, sizeof(req->reply));
+	if (client->transactionlogfd != -1)
+		writeit(client->transactionlogfd, &req->reply, sizeof(req->reply));
+	if (req->command == NBD_CMD_READ && !req->error)
+		writeit(client->net, req->data, req->len);
+	pthread_mutex_unlock(&client->sendlock);
+
+	if(req->buf >= 0)
+		engine->freebufs[engine->nfree++] = req->buf;
+	else
+		put_buffer(client, req->data);
+	engine->inflight--;
+	g_free(req);
+}
+
+/**
+ * Handle the completion of an operation.
+ *
+ * @param op The operation which completed
+ * @param res The result of the operation, as in io_uring_cqe.res
+ **/
+static void uring_complete_op(CLIENT *client, URING_OP *op, int res) {
+	URING_REQ *req = op->req;
+
+	if(res < 0) {
+		/* Like exptrim(), ignore failure to punch holes */
+		if(!req->error && op->opcode != IORING_OP_FALLOCATE)
+			req->error = -res;
+	} else if((op->opcode == IORING_OP_READ ||
+		   op->opcode == IORING_OP_WRITE) && res < op->len) {
+		if(!res) {
+			if(!req->error)
+				req->error = EIO;
+		} else {
+			/* Short read or write; go for the rest */
+			op->foffset += res;
+			op->buf += res;
+			op->len -= res;
+			uring_submit_op(client, op);
+			return;
+		}
+	}
+	if(res >= 0 && op->fileidx < client->export->len) {
+		if(op->opcode == IORING_OP_WRITE ||
+		   op->opcode == IORING_OP_FALLOCATE) {
+			mark_dirty(client->export, op->fileidx);
+			if(op->opcode == IORING_OP_WRITE)
+				pace_writeback(client, op->fileidx,
+					       op->foffset, res);
+		} else if(op->opcode == IORING_OP_FSYNC &&
+			  req->command == NBD_CMD_FLUSH) {
+			mark_clean(&g_array_index(client->export, FILE_INFO,
+						  op->fileidx),
+				   (gint)op->foffset);
+		}
+	}
+	g_free(op);
+	if(--req->pending == 0)
+		uring_finish_req(client, req);
+}
+
+/**
+ * Submit whatever is on the submission queue, and handle the operations
+ * which have completed.
+ *
+ * @param wait Whether to wait for at least one operation to complete
+ **/
+static void uring_reap(CLIENT *client, gboolean wait) {
+	struct io_uring *ring = &client->uring->ring;
+	struct io_uring_cqe *cqe;
+	URING_OP *op;
+	int res;
+	int ret;
+
+	io_uring_submit(ring);
+	for(;;) {
+		if(wait)
+			ret = io_uring_wait_cqe(ring, &cqe);
+		else
+			ret = io_uring_peek_cqe(ring, &cqe);
+		if(ret == -EINTR)
+			continue;
+		if(ret < 0 || !cqe)
+			break;
+		op = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(ring, cqe);
+		uring_complete_op(client, op, res);
+		wait = FALSE;
+	}
+	io_uring_submit(ring);
+}
+
+/**
+ * Wait until all requests on the ring have been replied to.
+ **/
+static void uring_drain(CLIENT *client) {
+	if(!client->uring)
+		return;
+	while(client->uring->inflight > 0)
+		uring_reap(client, TRUE);
+}
+
+/**
+ * Handle completions until the client sends us the next request.
+ **/
+static void uring_wait_for_request(CLIENT *client) {
+	struct pollfd fds[2];
+
+	if(!client->uring)
+		return;
+	fds[0].fd = client->net;
+	fds[0].events = POLLIN;
+	fds[1].fd = client->uring->ring.ring_fd;
+	fds[1].events = POLLIN;
+	for(;;) {
+		uring_reap(client, FALSE);
+		if(!client->uring->inflight)
+			return;
+		if(poll(fds, 2, -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			err("poll: %m");
+		}
+		if(fds[0].revents)
+			return;
+	}
+}
+
+/**
+ * Check whether a request can be handled by the io_uring engine. On
+ * O_DIRECT exports, that's only the case for aligned reads and writes,
+ * since the ring has no bounce buffers.
+ **/
+static gboolean can_queue_uring(CLIENT *client, uint16_t command, off_t a,
+				size_t len) {
+	if(!client->uring)
+		return FALSE;
+	switch(command) {
+	case NBD_CMD_WRITE:
+		if ((client->server->flags & F_READONLY) ||
+		    (client->server->flags & F_AUTOREADONLY))
+			return FALSE;
+		/* fall through */
+	case NBD_CMD_READ:
+		if((client->server->flags & F_DIRECT) &&
+		   ((a | len) & (client->directalign - 1)))
+			return FALSE;
+		return len <= BUFSIZE - sizeof(struct nbd_reply);
+	case NBD_CMD_TRIM:
+		if ((client->server->flags & F_READONLY) ||
+		    (client->server->flags & F_AUTOREADONLY))
+			return FALSE;
+		/* fall through */
+	case NBD_CMD_FLUSH:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * Put a request on the ring. For a write request, the data is read from
+ * the socket first; a flush request waits for all earlier requests to be
+ * replied to.
+ *
+ * @param client The client we received the request from
+ * @param request The request, as read by mainloop()
+ * @param len The length of the request, in host order
+ **/
+static void uring_queue_request(CLIENT *client, struct nbd_request *request,
+				size_t len) {
+	URING_ENGINE *engine = client->uring;
+	URING_REQ *req = g_new0(URING_REQ, 1);
+	uint16_t command = request->type & NBD_CMD_MASK_COMMAND;
+	off_t a = request->from;
+	char *buf;
+	size_t curlen;
+	FILE_INFO fi;
+	FILE_INFO *fp;
+	gint dirty;
+	int i;
+
+	req->reply.magic = htonl(NBD_REPLY_MAGIC);
+	memcpy(req->reply.handle, request->handle, sizeof(req->reply.handle));
+	req->command = command;
+	req->fua = request->type & NBD_CMD_FLAG_FUA;
+	req->len = len;
+	req->buf = -1;
+	if(command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
+		if(len <= URING_BUFSIZE) {
+			while(!engine->nfree)
+				uring_reap(client, TRUE);
+			req->buf = engine->freebufs[--engine->nfree];
+			req->data = engine->bufs + (size_t)req->buf * URING_BUFSIZE;
+		} else {
+			req->data = get_buffer(client, len);
+		}
+	}
+	if(command == NBD_CMD_WRITE) {
+		DEBUG("wr: net->buf, ");
+		readit(client->net, req->data, len);
+	}
+	if(command == NBD_CMD_FLUSH) {
+		async_wait(client, 0);
+		uring_drain(client);
+	}
+
+	engine->inflight++;
+	/* Hold on to the request until all of its operations are queued */
+	req->pending = 1;
+	if(command == NBD_CMD_FLUSH) {
+		/* Like expflush(), only sync files which were changed, and
+		 * only those in the range if one was given */
+		i = 0;
+		if(len && (i = get_fileidx(client->export, a)) < 0)
+			req->error = EINVAL;
+		for(; i >= 0 && i < client->export->len; i++) {
+			fp = &g_array_index(client->export, FILE_INFO, i);
+			if(len && fp->startoff >= a + (off_t)len)
+				break;
+			dirty = g_atomic_int_get(&fp->dirty);
+			if(dirty == g_atomic_int_get(&fp->clean))
+				continue;
+			uring_add_op(client, req, IORING_OP_FSYNC, i, dirty,
+				     NULL, 0, 0);
+		}
+	} else if((i = get_fileidx(client->export, a)) < 0) {
+		req->error = EINVAL;
+	} else {
+		buf = req->data;
+		req->firstfile = i;
+		/* Unless a part of it goes to a file without an O_DSYNC
+		 * descriptor, a FUA write needs no sync */
+		req->synced = req->fua && !(client->server->flags & F_SYNC);
+		while(len > 0 && i < client->export->len) {
+			fi = g_array_index(client->export, FILE_INFO, i);
+			curlen = get_segment_len(client->export, i, a, len);
+			if(command == NBD_CMD_TRIM) {
+#if HAVE_FALLOC_PH
+				uring_add_op(client, req, IORING_OP_FALLOCATE,
+					     i, a - fi.startoff, NULL, curlen,
+					     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE);
+#endif
+			} else if(command == NBD_CMD_WRITE && req->fua &&
+				  fi.dsynchandle >= 0) {
+				uring_add_op(client, req, IORING_OP_WRITE,
+					     i + client->export->len,
+					     a - fi.startoff, buf, curlen, 0);
+				buf += curlen;
+			} else {
+				uring_add_op(client, req,
+					     command == NBD_CMD_READ ?
+					     IORING_OP_READ : IORING_OP_WRITE,
+					     i, a - fi.startoff, buf, curlen, 0);
+				buf += curlen;
+				/* a FUA write which went here must be synced */
+				if(command == NBD_CMD_WRITE)
+					req->synced = FALSE;
+			}
+			req->lastfile = i;
+			a += curlen;
+			len -= curlen;
+			i++;
+		}
+	}
+	io_uring_submit(&engine->ring);
+	if(--req->pending == 0)
+		uring_finish_req(client, req);
+}
+
+/**
+ * Set up the io_uring engine for a client, with registered buffers and
+ * with the files of the export registered as fixed files. If that fails,
+ * the client is served with the default engine instead.
+ **/
+static void uring_setup(CLIENT *client) {
+	URING_ENGINE *engine;
+	struct iovec iov[URING_DEPTH];
+	FILE_INFO fi;
+	int *files;
+	int i;
+	int ret;
+
+	if(client->server->flags & F_COPYONWRITE) {
+		msg(LOG_INFO, "io_uring does not support copyonwrite exports; using the default I/O engine");
+		return;
+	}
+	engine = g_new0(URING_ENGINE, 1);
+	if((ret = io_uring_queue_init(URING_DEPTH, &engine->ring, 0)) < 0) {
+		msg(LOG_INFO, "Could not set up io_uring (%s); using the default I/O engine", strerror(-ret));
+		g_free(engine);
+		return;
+	}
+	if(posix_memalign((void**)&engine->bufs,
+			  MAX(DIFFPAGESIZE, client->directalign),
+			  (size_t)URING_DEPTH * URING_BUFSIZE))
+		err("Could not allocate memory");
+	for(i = 0; i < URING_DEPTH; i++) {
+		iov[i].iov_base = engine->bufs + (size_t)i * URING_BUFSIZE;
+		iov[i].iov_len = URING_BUFSIZE;
+		engine->freebufs[i] = i;
+	}
+	engine->nfree = URING_DEPTH;
+	/* The O_DSYNC descriptors come after the others; a file which
+	 * doesn't have one is registered twice, to keep the indices
+	 * simple */
+	files = g_new(int, 2 * client->export->len);
+	for(i = 0; i < client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		files[i] = fi.fhandle;
+		files[i + client->export->len] =
+			fi.dsynchandle >= 0 ? fi.dsynchandle : fi.fhandle;
+	}
+	if((ret = io_uring_register_buffers(&engine->ring, iov, URING_DEPTH)) < 0 ||
+	   (ret = io_uring_register_files(&engine->ring, files,
+					  2 * client->export->len)) < 0) {
+		msg(LOG_INFO, "Could not register with io_uring (%s); using the default I/O engine", strerror(-ret));
+		io_uring_queue_exit(&engine->ring);
+		free(engine->bufs);
+		g_free(engine);
+	} else {
+		client->uring = engine;
+	}
+	g_free(files);
+}
+
+/**
+ * Tear down the io_uring engine of a client, if it has one.
+ **/
+static void uring_teardown(CLIENT *client) {
+	if(!client->uring)
+		return;
+	uring_drain(client);
+	io_uring_queue_exit(&client->uring->ring);
+	free(client->uring->bufs);
+	g_free(client->uring);
+	client->uring = NULL;
+}
+#else
+static inline void uring_setup(CLIENT *client) {}
+static inline void uring_teardown(CLIENT *client) {}
+static inline void uring_drain(CLIENT *client) {}
+static inline void uring_wait_for_request(CLIENT *client) {}
+static inline gboolean can_queue_uring(CLIENT *client, uint16_t command,
+				       off_t a, size_t len) {
+	return FALSE;
+}
+static inline void uring_queue_request(CLIENT *client,
+				       struct nbd_request *request,
+				       size_t len) {}
+#endif /* HAVE_LIBURING */
+
+/**
+ * Free what mainloop() set up for a client. Called when mainloop()
+ * returns, and also when err() ends the thread of a connection halfway
+ * through it.
+ *
+ * @param data The client
+ **/
+static void mainloop_cleanup(void *data) {
+	CLIENT *client = data;
+	char *buf;
+
+	if(client->pool) {
+		g_thread_pool_free(client->pool, FALSE, TRUE);
+		client->pool = NULL;
+	}
+	uring_teardown(client);
+	if(client->server->flags & F_SPLICE) {
+		close(client->splicepipe[0]);
+		close(client->splicepipe[1]);
+	}
+	put_buffer(client, client->reqbuf);
+	client->reqbuf = NULL;
+	if(client->server->flags & F_DIRECT) {
+		while((buf = g_async_queue_try_pop(client->bufpool)))
+			free(buf);
+		g_async_queue_unref(client->bufpool);
+	}
+}
+
 /**
  * Serve a file to a single client.
  *
@@ -1748,25 +4629,69 @@ int mainloop(CLIENT *client) {
 	struct nbd_request request;
 	struct nbd_reply reply;
 	gboolean go_on=TRUE;
+	char *buf;
 #ifdef DODBG
 	int i = 0;
 #endif
 	negotiate(client->net, client, NULL, client->modern ? NEG_MODERN : (NEG_OLD | NEG_INIT));
+	pthread_mutex_init(&client->lock, NULL);
+	pthread_mutex_init(&client->sendlock, NULL);
+	pthread_mutex_init(&client->directlock, NULL);
+	pthread_cond_init(&client->idle, NULL);
+	if(client->server->flags & F_DIRECT) {
+		client->directbufsize = (BUFSIZE + client->directalign - 1) &
+			~(client->directalign - 1);
+		client->bufpool = g_async_queue_new();
+	}
+	buf = NULL;
+	client->reqbuf = NULL;
+	client->inflight = 0;
+	client->pool = NULL;
+	/* With threaded, an error on the connection only ends the thread
+	 * which serves it, so no other thread may be working for it */
+	if(client->server->iothreads > 0 && !(glob_flags & F_THREADED)) {
+		client->pool = g_thread_pool_new(handle_async_request, client,
+						 client->server->iothreads,
+						 TRUE, NULL);
+	}
+	client->uring = NULL;
+	if(client->server->ioengine == IOENGINE_URING &&
+	   !(glob_flags & F_THREADED)) {
+		uring_setup(client);
+	}
+#ifdef HAVE_SPLICE
+	if(client->server->flags & F_SPLICE) {
+		if(pipe(client->splicepipe) < 0)
+			err("Could not create pipe: %m");
+#ifdef F_SETPIPE_SZ
+		/* Large enough for a whole request, if we're allowed to */
+		fcntl(client->splicepipe[1], F_SETPIPE_SZ, BUFSIZE);
+#endif
+	}
+#endif
+	pthread_cleanup_push(mainloop_cleanup, client);
 	DEBUG("Entering request loop!\n");
 	reply.magic = htonl(NBD_REPLY_MAGIC);
 	reply.error = 0;
 	while (go_on) {
-		char buf[BUFSIZE];
-		char* p;
 		size_t len;
 		size_t currlen;
-		size_t writelen;
 		uint16_t command;
 #ifdef DODBG
 		i++;
 		printf("%d: ", i);
 #endif
+		if((glob_flags & F_THREADED) && buf) {
+			/* Don't keep a buffer while the client is idle; a
+			 * threaded server may have thousands of them */
+			put_buffer(client, buf);
+			client->reqbuf = buf = NULL;
+		}
+		uring_wait_for_request(client);
 		readit(client->net, &request, sizeof(request));
+		if(!buf) {
+			client->reqbuf = buf = get_buffer(client, BUFSIZE);
+		}
 		if (client->transactionlogfd != -1)
 			writeit(client->transactionlogfd, &request, sizeof(request));
 
@@ -1806,16 +4731,52 @@ int mainloop(CLIENT *client) {
 				}
 			}
 		}
+		if (command == NBD_CMD_READ) {
+			follow_stream(client, request.from, len);
+		}
+
+		if (command == NBD_CMD_WRITE &&
+		    can_splice_write(client, request.from, len)) {
+			DEBUG("wr: net->exp, ");
+			if (splice_write(request.from, len, client,
+					 request.type & NBD_CMD_FLAG_FUA)) {
+				DEBUG("Write failed: %m");
+				ERROR(client, reply, errno);
+				continue;
+			}
+			SEND(client->net, reply);
+			DEBUG("OK!\n");
+			continue;
+		}
+		if (can_queue_uring(client, command, request.from, len)) {
+			uring_queue_request(client, &request, len);
+			continue;
+		}
+		if (can_queue_async(client, command, len)) {
+			queue_async_request(client, &request, len);
+			continue;
+		}
+		/* Everything else is handled in order */
+		async_wait(client, 0);
+		uring_drain(client);
 
 		switch (command) {
 
 		case NBD_CMD_DISC:
 			msg(LOG_INFO, "Disconnect request received.");
+			if (client->blockcache || client->sharedepoch)
+				msg(LOG_INFO, "Block cache: %llu hits, %llu misses",
+				    (unsigned long long)client->cachehits,
+				    (unsigned long long)client->cachemisses);
                 	if (client->server->flags & F_COPYONWRITE) { 
-				if (client->difmap) g_free(client->difmap) ;
+				cowmap_free(client->difmap);
                 		close(client->difffile);
+				if (client->difffiledsync >= 0)
+					close(client->difffiledsync);
 				unlink(client->difffilename);
 				free(client->difffilename);
+				client->difmap = NULL;
+				client->difffilename = NULL;
 			}
 			go_on=FALSE;
 			continue;
@@ -1849,7 +4810,7 @@ int mainloop(CLIENT *client) {
 
 		case NBD_CMD_FLUSH:
 			DEBUG("fl: ");
-			if (expflush(client)) {
+			if (expflush(client, request.from, len)) {
 				DEBUG("Flush failed: %m");
 				ERROR(client, reply, errno);
 				continue;
@@ -1859,55 +4820,170 @@ int mainloop(CLIENT *client) {
 			continue;
 
 		case NBD_CMD_READ:
+			if (can_send_zerocopy(client, request.from, len)) {
+				DEBUG("exp->net, ");
+				SEND(client->net, reply);
+				if (expsend(request.from, len, client))
+					err("Read failed: %m");
+				DEBUG("OK!\n");
+				continue;
+			}
 			DEBUG("exp->buf, ");
-			if (client->transactionlogfd != -1)
-				writeit(client->transactionlogfd, &reply, sizeof(reply));
-			writeit(client->net, &reply, sizeof(reply));
-			p = buf;
-			writelen = currlen;
+			/* Read the first part before the reply header goes
+			 * out, so that an error can still be reported. Once
+			 * part of the data has been sent, all that's left to do
+			 * on an error is to drop the connection. */
+			if (expread(request.from, buf, currlen, client)) {
+				DEBUG("Read failed: %m");
+				ERROR(client, reply, errno);
+				continue;
+			}
+			SEND(client->net, reply);
 			while(len > 0) {
-				if (expread(request.from, p, currlen, client)) {
-					DEBUG("Read failed: %m");
-					ERROR(client, reply, errno);
-					continue;
-				}
-				
 				DEBUG("buf->net, ");
-				writeit(client->net, buf, writelen);
+				writeit(client->net, buf, currlen);
 				len -= currlen;
 				request.from += currlen;
 				currlen = (len < BUFSIZE) ? len : BUFSIZE;
-				p = buf;
-				writelen = currlen;
+				if (len > 0 && expread(request.from, buf, currlen, client))
+					err("Read failed: %m");
 			}
 			DEBUG("OK!\n");
 			continue;
 
-		case NBD_CMD_TRIM:
-			/* The kernel module sets discard_zeroes_data == 0,
-			 * so it is okay to do nothing.  */
-			if (exptrim(&request, client)) {
-				DEBUG("Trim failed: %m");
-				ERROR(client, reply, errno);
-				continue;
-			}
-			SEND(client->net, reply);
-			continue;
+		case NBD_CMD_TRIM:
+			/* The kernel module sets discard_zeroes_data == 0,
+			 * so it is okay to do nothing.  */
+			if (exptrim(&request, client)) {
+				DEBUG("Trim failed: %m");
+				ERROR(client, reply, errno);
+				continue;
+			}
+			SEND(client->net, reply);
+			continue;
+
+		default:
+			DEBUG ("Ignoring unknown command\n");
+			continue;
+		}
+	}
+	pthread_cleanup_pop(1);
+	return 0;
+}
+
+/**
+ * Switch the files of an export to O_DIRECT, and find out how buffers,
+ * offsets and lengths must be aligned for that. That is the logical
+ * block size for block devices, and the block size (but no more than a
+ * page) for regular files.
+ *
+ * @param client The client the export was set up for
+ * @param gerror Set if that isn't possible
+ * @return TRUE on success
+ **/
+static gboolean setupdirect(CLIENT* client, GError **const gerror) {
+#ifdef O_DIRECT
+	FILE_INFO fi;
+	struct stat stat_buf;
+	size_t align = 512;
+	int blksize;
+	int flags;
+	int i;
+
+	for(i=0; i<client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		if((flags = fcntl(fi.fhandle, F_GETFL)) < 0 ||
+		   fcntl(fi.fhandle, F_SETFL, flags | O_DIRECT) < 0) {
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+				    "Could not use O_DIRECT on exported file: %s",
+				    strerror(errno));
+			return FALSE;
+		}
+		if(fi.dsynchandle >= 0 &&
+		   ((flags = fcntl(fi.dsynchandle, F_GETFL)) < 0 ||
+		    fcntl(fi.dsynchandle, F_SETFL, flags | O_DIRECT) < 0)) {
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+				    "Could not use O_DIRECT on exported file: %s",
+				    strerror(errno));
+			return FALSE;
+		}
+		if(fstat(fi.fhandle, &stat_buf) < 0) {
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+				    "fstat failed: %s", strerror(errno));
+			return FALSE;
+		}
+		blksize = MIN(stat_buf.st_blksize, DIFFPAGESIZE);
+#ifdef BLKSSZGET
+		if(S_ISBLK(stat_buf.st_mode)) {
+			ioctl(fi.fhandle, BLKSSZGET, &blksize);
+		}
+#endif
+		if(blksize > align) {
+			align = blksize;
+		}
+	}
+	/* Files must consist of whole blocks, or the last one couldn't be
+	 * written to */
+	for(i=0; i<client->export->len; i++) {
+		fi = g_array_index(client->export, FILE_INFO, i);
+		if(fstat(fi.fhandle, &stat_buf) < 0) {
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+				    "fstat failed: %s", strerror(errno));
+			return FALSE;
+		}
+		if(S_ISREG(stat_buf.st_mode) && (stat_buf.st_size & (align - 1))) {
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+				    "Size of exported file is not a multiple of the block size O_DIRECT needs");
+			return FALSE;
+		}
+	}
+	client->directalign = align;
+	msg(LOG_INFO, "Using O_DIRECT with an alignment of %d bytes", (int)align);
+#endif
+	return TRUE;
+}
+
+/**
+ * Get the name of one of the files of an export.
+ *
+ * @param client The client the export is set up for
+ * @param i The index of the file, for multifile exports
+ * @return the name, to be freed with g_free()
+ **/
+static gchar *export_file_name(CLIENT *client, int i) {
+	if(client->server->flags & F_MULTIFILE) {
+		return g_strdup_printf("%s.%d", client->exportname, i);
+	}
+	return g_strdup(client->exportname);
+}
+
+/**
+ * Close the files of an export and free the array of them.
+ **/
+static void close_export(GArray *export) {
+	int i;
 
-		default:
-			DEBUG ("Ignoring unknown command\n");
-			continue;
+	for(i=0; i<export->len; i++) {
+		close(g_array_index(export, FILE_INFO, i).fhandle);
+		if(g_array_index(export, FILE_INFO, i).dsynchandle >= 0) {
+			close(g_array_index(export, FILE_INFO, i).dsynchandle);
+		}
+		if(g_array_index(export, FILE_INFO, i).writeback) {
+			pthread_mutex_destroy(&g_array_index(export, FILE_INFO, i).writeback->lock);
+			g_free(g_array_index(export, FILE_INFO, i).writeback);
 		}
 	}
-	return 0;
+	g_array_free(export, TRUE);
 }
 
 /**
  * Set up client export array, which is an array of FILE_INFO.
  * Also, split a single exportfile into multiple ones, if that was asked.
  * @param client information on the client which we want to setup export for
+ * @param gerror Set if the files can't be opened or used
+ * @return TRUE on success; on failure, no files are left open
  **/
-void setupexport(CLIENT* client) {
+static gboolean open_export(CLIENT* client, GError **const gerror) {
 	int i;
 	off_t laststartoff = 0, lastsize = 0;
 	int multifile = (client->server->flags & F_MULTIFILE);
@@ -1922,7 +4998,6 @@ void setupexport(CLIENT* client) {
 	for(i=0; ; i++) {
 		FILE_INFO fi;
 		gchar *tmpname;
-		gchar* error_string;
 
 		if (i)
 		  cancreate = 0;
@@ -1935,11 +5010,7 @@ void setupexport(CLIENT* client) {
 			DEBUG( "Opening %s\n", tmpname );
 			fi.fhandle = mkstemp(tmpname);
 		} else {
-			if(multifile) {
-				tmpname=g_strdup_printf("%s.%d", client->exportname, i);
-			} else {
-				tmpname=g_strdup(client->exportname);
-			}
+			tmpname=export_file_name(client, i);
 			DEBUG( "Opening %s\n", tmpname );
 			fi.fhandle = open(tmpname, mode, 0x600);
 			if(fi.fhandle == -1 && mode == O_RDWR) {
@@ -1956,18 +5027,39 @@ void setupexport(CLIENT* client) {
 			}
 		}
 		if(fi.fhandle == -1) {
-			if(multifile && i>0)
+			if(multifile && i>0) {
+				g_free(tmpname);
 				break;
-			error_string=g_strdup_printf(
-				"Could not open exported file %s: %%m",
-				tmpname);
-			err(error_string);
+			}
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+				    "Could not open exported file %s: %s",
+				    tmpname, strerror(errno));
+			g_free(tmpname);
+			goto out;
+		}
+
+		/* FUA writes go to a descriptor of their own, so that they
+		 * are synced by themselves instead of with a sync of
+		 * everything that was written to the file */
+		fi.dsynchandle = -1;
+		if((client->server->flags & F_FUA) &&
+		   !(client->server->flags & (F_READONLY | F_COPYONWRITE))) {
+			fi.dsynchandle = open(tmpname, O_RDWR | O_DSYNC);
 		}
 
 		if (temporary)
 			unlink(tmpname); /* File will stick around whilst FD open */
 
 		fi.startoff = laststartoff + lastsize;
+		/* what was written before we opened it may not be synced */
+		fi.dirty = 1;
+		fi.clean = 0;
+		fi.writeback = NULL;
+		if(client->server->writeback > 0 &&
+		   !(client->server->flags & (F_READONLY | F_COPYONWRITE))) {
+			fi.writeback = g_new0(WRITEBACK, 1);
+			pthread_mutex_init(&fi.writeback->lock, NULL);
+		}
 		g_array_append_val(client->export, fi);
 		g_free(tmpname);
 
@@ -1980,12 +5072,16 @@ void setupexport(CLIENT* client) {
 		if (!lastsize && cancreate) {
 			assert(!multifile);
 			if(ftruncate (fi.fhandle, client->server->expected_size)<0) {
-				err("Could not expand file: %m");
+				g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+					    "Could not expand file: %s",
+					    strerror(errno));
+				goto out;
 			}
 			lastsize = client->server->expected_size;
-			break; /* don't look for any more files */
 		}
+		g_array_index(client->export, FILE_INFO, i).size = lastsize;
 
+		/* a file we created is the only one */
 		if(!multifile || temporary)
 			break;
 	}
@@ -1997,7 +5093,9 @@ void setupexport(CLIENT* client) {
 	if(client->server->expected_size) {
 		/* desired size must be <= total calculated size */
 		if(client->server->expected_size > client->exportsize) {
-			err("Size of exported file is too big\n");
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_EXPORT,
+				    "Size of exported file is too big");
+			goto out;
 		}
 
 		client->exportsize = client->server->expected_size;
@@ -2007,21 +5105,61 @@ void setupexport(CLIENT* client) {
 	if(multifile) {
 		msg(LOG_INFO, "Total number of files: %d", i);
 	}
+	client->directalign = 0;
+	if(client->server->flags & F_DIRECT) {
+		if(!setupdirect(client, gerror)) {
+			goto out;
+		}
+	}
+	advise_export(client);
+	client->blockcache = get_block_cache(client);
+	return TRUE;
+
+out:
+	close_export(client->export);
+	client->export = NULL;
+	return FALSE;
+}
+
+/**
+ * Set up the export of a client, exiting if that isn't possible.
+ *
+ * @param client information on the client which we want to setup export for
+ **/
+void setupexport(CLIENT* client) {
+	GError *gerror = NULL;
+
+	if(!open_export(client, &gerror)) {
+		err(gerror->message);
+	}
 }
 
 int copyonwrite_prepare(CLIENT* client) {
-	off_t i;
+	static gint diffcount = 0;
+	off_t bs = client->server->cowblocksize;
 	if ((client->difffilename = malloc(1024))==NULL)
 		err("Failed to allocate string for diff file name");
-	snprintf(client->difffilename, 1024, "%s-%s-%d.diff",client->exportname,client->clientname,
-		(int)getpid()) ;
+	if (glob_flags & F_THREADED) {
+		/* All connections share our PID */
+		snprintf(client->difffilename, 1024, "%s-%s-%d-%d.diff",
+			 client->exportname, client->clientname, (int)getpid(),
+			 g_atomic_int_add(&diffcount, 1));
+	} else {
+		snprintf(client->difffilename, 1024, "%s-%s-%d.diff",client->exportname,client->clientname,
+			(int)getpid()) ;
+	}
 	client->difffilename[1023]='\0';
 	msg(LOG_INFO, "About to create map and diff file %s", client->difffilename) ;
 	client->difffile=open(client->difffilename,O_RDWR | O_CREAT | O_TRUNC,0600) ;
 	if (client->difffile<0) err("Could not create diff file (%m)") ;
-	if ((client->difmap=calloc(client->exportsize/DIFFPAGESIZE,sizeof(u32)))==NULL)
+	client->difffiledsync = -1;
+	if (client->server->flags & F_FUA)
+		client->difffiledsync = open(client->difffilename, O_RDWR | O_DSYNC);
+	if ((client->difmap=cowmap_new((client->exportsize+bs-1)/bs))==NULL)
 		err("Could not allocate memory") ;
-	for (i=0;i<client->exportsize/DIFFPAGESIZE;i++) client->difmap[i]=(u32)-1 ;
+	pthread_rwlock_init(&client->cowlock, NULL);
+	pthread_mutex_init(&client->cowwaitlock, NULL);
+	pthread_cond_init(&client->cowdone, NULL);
 
 	return 0;
 }
@@ -2045,6 +5183,419 @@ int do_run(gchar* command, gchar* file) {
 	return retval;
 }
 
+/**
+ * An entry in the export registry: the files of an export, opened and
+ * sized once and handed to every connection to it. The registry is
+ * filled by the main process before connections come in, so that the
+ * processes it forks to serve them inherit it; a threaded server
+ * shares it between all connections.
+ **/
+struct export_cache {
+	gchar *exportname;	/**< the name the files were opened with */
+	GArray *export;		/**< the files, as set up by open_export() */
+	GArray *stamps;		/**< a FILE_STAMP for each of the files */
+	off_t exportsize;	/**< size of the export */
+	size_t directalign;	/**< alignment for O_DIRECT */
+	BLOCK_CACHE *blockcache; /**< the block cache of the export, or NULL */
+	int refcount;		/**< number of clients using the files, plus
+				  one while the entry is in the registry */
+};
+
+GHashTable *exportcache = NULL; /**< the export registry: the
+				     EXPORT_CACHE of each SERVER whose files
+				     are kept open */
+pid_t exportcacheowner = 0; /**< the process which filled exportcache,
+			      and which its children tell when an export
+			      in it changed */
+pthread_mutex_t exportlock = PTHREAD_MUTEX_INITIALIZER; /**< protects
+							      exportcache and
+							      the refcounts
+							      of its entries */
+
+/**
+ * Check whether the files of an export may be kept open for the next
+ * connection. That's not the case for temporary exports, or if a
+ * prerun or postrun command might change the files.
+ **/
+static gboolean can_cache_export(SERVER *serve) {
+	return !(serve->flags & F_TEMPORARY) &&
+		!(serve->prerun && *(serve->prerun)) &&
+		!(serve->postrun && *(serve->postrun));
+}
+
+/**
+ * Check whether the files of a registry entry are still the ones which
+ * the client's export name refers to, with the same size. The
+ * modification time is of no use for this, since writes of the clients
+ * themselves change it.
+ *
+ * @return TRUE if the entry can be used
+ **/
+static gboolean export_unchanged(CLIENT *client, EXPORT_CACHE *cached) {
+	struct stat stat_buf;
+	FILE_STAMP *stamp;
+	gchar *name;
+	int ret;
+	int i;
+
+	for(i=0; i<cached->stamps->len; i++) {
+		stamp = &g_array_index(cached->stamps, FILE_STAMP, i);
+		name = export_file_name(client, i);
+		ret = stat(name, &stat_buf);
+		g_free(name);
+		if(ret < 0 || stat_buf.st_dev != stamp->dev ||
+		   stat_buf.st_ino != stamp->ino ||
+		   stat_buf.st_size != stamp->size) {
+			return FALSE;
+		}
+	}
+	if(client->server->flags & F_MULTIFILE) {
+		/* a file was added to the end */
+		name = export_file_name(client, i);
+		ret = stat(name, &stat_buf);
+		g_free(name);
+		if(ret == 0) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Drop a reference to a registry entry, closing its files when it was
+ * the last one. Must be called with exportlock held.
+ **/
+static void unref_export(EXPORT_CACHE *cached) {
+	if(--cached->refcount > 0) {
+		return;
+	}
+	close_export(cached->export);
+	put_block_cache(cached->blockcache);
+	g_array_free(cached->stamps, TRUE);
+	g_free(cached->exportname);
+	g_free(cached);
+}
+
+/**
+ * Set up the export of a client from the registry, if the files of its
+ * server are in there and haven't changed since they were opened.
+ *
+ * @return TRUE if that worked, FALSE if setupexport() must be called
+ **/
+static gboolean get_cached_export(CLIENT *client) {
+	EXPORT_CACHE *cached;
+
+	if(!exportcache) {
+		return FALSE;
+	}
+	pthread_mutex_lock(&exportlock);
+	if(!(cached = g_hash_table_lookup(exportcache, client->server)) ||
+	   strcmp(cached->exportname, client->exportname)) {
+		pthread_mutex_unlock(&exportlock);
+		return FALSE;
+	}
+	if(!export_unchanged(client, cached)) {
+		msg(LOG_INFO, "Export %s changed, opening it again", client->exportname);
+		g_hash_table_remove(exportcache, client->server);
+		unref_export(cached);
+		pthread_mutex_unlock(&exportlock);
+		if(getpid() != exportcacheowner) {
+			/* so that the next connections don't find out again */
+			kill(exportcacheowner, SIGUSR1);
+		}
+		return FALSE;
+	}
+	cached->refcount++;
+	client->export = cached->export;
+	client->exportsize = cached->exportsize;
+	client->directalign = cached->directalign;
+	client->blockcache = cached->blockcache;
+	client->cached = cached;
+	pthread_mutex_unlock(&exportlock);
+	msg(LOG_INFO, "Reusing open export, size %llu", (unsigned long long)client->exportsize);
+	return TRUE;
+}
+
+/**
+ * Add the files of a client's export to the registry, for other
+ * connections to the same server, if possible. With virtstyle, that is
+ * only of use to a client which gets the same file name.
+ **/
+static void cache_export(CLIENT *client) {
+	EXPORT_CACHE *cached;
+	struct stat stat_buf;
+	FILE_STAMP stamp;
+	int i;
+
+	if(!exportcache || !can_cache_export(client->server)) {
+		return;
+	}
+	pthread_mutex_lock(&exportlock);
+	if(!g_hash_table_lookup(exportcache, client->server)) {
+		cached = g_new0(EXPORT_CACHE, 1);
+		cached->stamps = g_array_new(FALSE, FALSE, sizeof(FILE_STAMP));
+		for(i=0; i<client->export->len; i++) {
+			if(fstat(g_array_index(client->export, FILE_INFO, i).fhandle,
+				 &stat_buf) < 0) {
+				g_array_free(cached->stamps, TRUE);
+				g_free(cached);
+				pthread_mutex_unlock(&exportlock);
+				return;
+			}
+			stamp_file(&stamp, &stat_buf);
+			g_array_append_val(cached->stamps, stamp);
+		}
+		cached->exportname = g_strdup(client->exportname);
+		cached->export = client->export;
+		cached->exportsize = client->exportsize;
+		cached->directalign = client->directalign;
+		cached->blockcache = client->blockcache;
+		cached->refcount = 2;
+		g_hash_table_insert(exportcache, client->server, cached);
+		client->cached = cached;
+	}
+	pthread_mutex_unlock(&exportlock);
+}
+
+/**
+ * Callback for g_hash_table_foreach_remove() which drops the registry's
+ * reference to an entry.
+ **/
+static gboolean drop_cached_export(gpointer key, gpointer value,
+				   gpointer user_data) {
+	unref_export(value);
+	return TRUE;
+}
+
+/**
+ * Empty the export registry, so that exports are opened again. Clients
+ * which are using the files keep them open until they're done.
+ **/
+static void flush_export_cache(void) {
+	pthread_mutex_lock(&exportlock);
+	g_hash_table_foreach_remove(exportcache, drop_cached_export, NULL);
+	pthread_mutex_unlock(&exportlock);
+}
+
+/**
+ * Check whether the files of a server's export can be opened before a
+ * client connects: they don't depend on the client, and a client can
+ * get to this server. Negotiation picks the first server with the
+ * name a client asks for, so a copy of it which was made to listen on
+ * another address is only of use for oldstyle clients on its own port.
+ **/
+static gboolean can_fill_export_cache(GArray *servers, int idx) {
+	SERVER *serve = &g_array_index(servers, SERVER, idx);
+	int i;
+
+	/* Without a format in it, the name is the same for all clients
+	 * whatever the virtstyle */
+	if(!can_cache_export(serve) ||
+	   (serve->virtstyle != VIRT_NONE && strchr(serve->exportname, '%'))) {
+		return FALSE;
+	}
+	if(serve->socket >= 0 || !serve->servename) {
+		return TRUE;
+	}
+	for(i=0; i<idx; i++) {
+		SERVER *other = &g_array_index(servers, SERVER, i);
+
+		if(other->servename && !strcmp(other->servename, serve->servename)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Open the files of a server's export and add them to the registry.
+ * An export which can't be opened now is left to the connections to
+ * it, which report why.
+ **/
+static void fill_export_cache_entry(SERVER *serve) {
+	GError *gerror = NULL;
+	CLIENT client;
+
+	memset(&client, 0, sizeof(client));
+	client.server = serve;
+	client.exportname = serve->exportname;
+	if(!open_export(&client, &gerror)) {
+		msg(LOG_INFO, "Not keeping export %s open: %s",
+		    client.exportname, gerror->message);
+		g_error_free(gerror);
+		return;
+	}
+	cache_export(&client);
+	if(client.cached) {
+		pthread_mutex_lock(&exportlock);
+		unref_export(client.cached);
+		pthread_mutex_unlock(&exportlock);
+	} else {
+		close_export(client.export);
+		put_block_cache(client.blockcache);
+	}
+}
+
+/**
+ * Open the exports whose files don't depend on the client ahead of
+ * connections, and add them to the registry.
+ *
+ * @param servers The array of servers
+ **/
+static void fill_export_cache(GArray *servers) {
+	int i;
+
+	for(i=0; i<servers->len; i++) {
+		if(can_fill_export_cache(servers, i) &&
+		   !g_hash_table_lookup(exportcache,
+					&g_array_index(servers, SERVER, i))) {
+			fill_export_cache_entry(&g_array_index(servers, SERVER, i));
+		}
+	}
+}
+
+/**
+ * Open the exports in the registry again whose files were replaced or
+ * resized. A process which is forked to serve a connection can't
+ * update the registry of its parent; when it finds an export to have
+ * changed, it tells the parent, which calls this. Connections don't
+ * wait for it: each checks the files of its own export only, in
+ * get_cached_export().
+ *
+ * @param servers The array of servers
+ **/
+static void refresh_export_cache(GArray *servers) {
+	EXPORT_CACHE *cached;
+	CLIENT client;
+	int i;
+
+	for(i=0; i<servers->len; i++) {
+		memset(&client, 0, sizeof(client));
+		client.server = &g_array_index(servers, SERVER, i);
+		if(!(cached = g_hash_table_lookup(exportcache, client.server))) {
+			continue;
+		}
+		client.exportname = cached->exportname;
+		if(export_unchanged(&client, cached)) {
+			continue;
+		}
+		msg(LOG_INFO, "Export %s changed, opening it again", client.exportname);
+		g_hash_table_remove(exportcache, client.server);
+		unref_export(cached);
+		fill_export_cache_entry(client.server);
+	}
+}
+
+/**
+ * Check whether the cache of an export can be shared between
+ * processes. As nothing invalidates the blocks in it, that's only
+ * possible if the server doesn't write to the file, and all clients
+ * get the same one. Multi-file exports are left out, so that a
+ * connection only has to check a single file to tell whether the
+ * blocks are still of use.
+ **/
+static gboolean can_share_cache(SERVER *serve) {
+	return (serve->flags & (F_READONLY | F_COPYONWRITE)) &&
+		!(serve->flags & F_MULTIFILE) &&
+		serve->ioengine != IOENGINE_URING &&
+		serve->cachesize >= CACHEBLOCKSIZE * SHARED_CACHE_WAYS &&
+		can_cache_export(serve) &&
+		(serve->virtstyle == VIRT_NONE || !strchr(serve->exportname, '%'));
+}
+
+/**
+ * Set up the shared block caches of the servers which want one. This
+ * must be done before the processes which serve connections are
+ * forked, so that they all get the same memory.
+ *
+ * @param servers The array of servers
+ **/
+static void setup_shared_caches(GArray *servers) {
+	pthread_mutexattr_t attr;
+	SHARED_CACHE *cache;
+	SERVER *serve;
+	guint nsets;
+	size_t size;
+	int i;
+	int j;
+
+	for(i=0; i<servers->len; i++) {
+		serve = &g_array_index(servers, SERVER, i);
+		if(!(serve->flags & F_SHAREDCACHE) || serve->sharedcache) {
+			continue;
+		}
+		if(!can_share_cache(serve)) {
+			msg(LOG_INFO, "Not sharing the cache of %s: only read-only and copy-on-write exports of a single file, the same for all clients, can",
+			    serve->exportname);
+			serve->flags &= ~F_SHAREDCACHE;
+			continue;
+		}
+		/* a copy of the server which listens on another address */
+		for(j=0; j<i; j++) {
+			SERVER *other = &g_array_index(servers, SERVER, j);
+
+			if(other->sharedcache &&
+			   !strcmp(other->exportname, serve->exportname) &&
+			   (other->flags & F_MULTIFILE) == (serve->flags & F_MULTIFILE) &&
+			   other->cachesize == serve->cachesize) {
+				serve->sharedcache = other->sharedcache;
+				break;
+			}
+		}
+		if(serve->sharedcache) {
+			continue;
+		}
+		nsets = serve->cachesize / (CACHEBLOCKSIZE * SHARED_CACHE_WAYS);
+		size = sizeof(SHARED_CACHE) +
+			(size_t)nsets * SHARED_CACHE_WAYS * sizeof(SHARED_BLOCK);
+		cache = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if(cache == MAP_FAILED) {
+			msg(LOG_ERR, "Could not map the shared cache of %s: %m",
+			    serve->exportname);
+			serve->flags &= ~F_SHAREDCACHE;
+			continue;
+		}
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutex_init(&cache->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		cache->nsets = nsets;
+		serve->sharedcache = cache;
+		msg(LOG_INFO, "Sharing a cache of %u blocks of %s between processes",
+		    nsets * SHARED_CACHE_WAYS, serve->exportname);
+	}
+}
+
+/**
+ * Start using the shared block cache of a client's server, if it has
+ * one, once the file of its export was opened. If it isn't the file the
+ * cache was last used with, or it was modified since, what the cache
+ * holds is of no use any more. Since the server doesn't write to the
+ * file, its modification time tells whether it was modified in place.
+ **/
+static void attach_shared_cache(CLIENT *client) {
+	SHARED_CACHE *cache = client->server->sharedcache;
+	struct stat stat_buf;
+	FILE_STAMP stamp;
+
+	if(!cache ||
+	   fstat(g_array_index(client->export, FILE_INFO, 0).fhandle, &stat_buf) < 0) {
+		return;
+	}
+	stamp_file(&stamp, &stat_buf);
+	pthread_mutex_lock(&cache->lock);
+	if(!cache->epoch || cache->stamp.dev != stamp.dev ||
+	   cache->stamp.ino != stamp.ino || cache->stamp.size != stamp.size ||
+	   cache->stamp.mtime.tv_sec != stamp.mtime.tv_sec ||
+	   cache->stamp.mtime.tv_nsec != stamp.mtime.tv_nsec) {
+		cache->stamp = stamp;
+		cache->epoch++;
+	}
+	client->sharedepoch = cache->epoch;
+	pthread_mutex_unlock(&cache->lock);
+}
+
 /**
  * Serve a connection. 
  *
@@ -2064,9 +5615,14 @@ void serveconnection(CLIENT *client) {
 	}
 
 	if(do_run(client->server->prerun, client->exportname)) {
-		exit(EXIT_FAILURE);
+		err("Prerun command failed");
+	}
+	if(!get_cached_export(client)) {
+		setupexport(client);
+		cache_export(client);
 	}
-	setupexport(client);
+	mark_export_dirty(client);
+	attach_shared_cache(client);
 
 	if (client->server->flags & F_COPYONWRITE) {
 		copyonwrite_prepare(client);
@@ -2191,24 +5747,254 @@ int set_peername(int net, CLIENT *client) {
 }
 
 /**
- * Destroy a pid_t*
- * @param data a pointer to pid_t which should be freed
+ * Destroy a pid_t*
+ * @param data a pointer to pid_t which should be freed
+ **/
+void destroy_pid_t(gpointer data) {
+	g_free(data);
+}
+
+#ifdef USE_EPOLL
+#define LISTEN_MAXEVENTS 64 /**< maximum number of events to handle per
+			      wakeup of serveloop() */
+#else
+fd_set listenset;	/**< The listening sockets, if USE_EPOLL is
+			     not defined */
+int listenmax = -1;	/**< The highest fd in listenset */
+#endif
+#define LISTEN_MODERN (-1) /**< add_listener() index of a modern socket */
+#define LISTEN_WORKER (-2) /**< add_listener() index of the socket to a
+			     pre-forked worker */
+
+/**
+ * Add a socket to the set serveloop() waits on. The socket is made
+ * non-blocking, so that its backlog can be drained on every wakeup.
+ *
+ * @param sock The socket
+ * @param servidx The index of its server in the servers array for an
+ * oldstyle socket, LISTEN_MODERN for a modern one, or LISTEN_WORKER for
+ * the socket to a worker
+ **/
+static void add_listener(int sock, int servidx) {
+	int flags;
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+#endif
+
+	if((flags = fcntl(sock, F_GETFL, 0)) == -1 ||
+	   fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		err("fcntl O_NONBLOCK on listening socket: %m");
+	}
+#ifdef USE_EPOLL
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	/* An index rather than a pointer, since the servers array can be
+	 * reallocated when SIGHUP adds servers to it */
+	ev.data.u64 = ((uint64_t)(uint32_t)servidx << 32) | (uint32_t)sock;
+	if(epoll_ctl(listenfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		err("epoll_ctl: %m");
+	}
+#else
+	FD_SET(sock, &listenset);
+	listenmax = sock > listenmax ? sock : listenmax;
+#endif
+}
+
+/**
+ * Remove a socket from the set serveloop() waits on. This must be done
+ * before closing it, since children may still have it open.
+ **/
+static void remove_listener(int sock) {
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+
+	epoll_ctl(listenfd, EPOLL_CTL_DEL, sock, &ev);
+#else
+	FD_CLR(sock, &listenset);
+#endif
+}
+
+/**
+ * A pre-forked worker process, which serves the connections the parent
+ * hands to it one after the other
+ **/
+typedef struct {
+	pid_t pid;		/**< process ID of the worker */
+	int fd;			/**< our end of the socket to the worker */
+	gboolean idle;		/**< whether it waits for a connection */
+	int generation;		/**< workergen when it was started */
+} WORKER;
+
+/**
+ * What the parent sends to a worker along with a connection
+ **/
+typedef struct {
+	int servidx;		/**< index of the server in the servers
+				     array, or LISTEN_MODERN */
+	guint connections;	/**< number of connections which were being
+				     served when this one came in */
+} WORKER_MSG;
+
+/**
+ * A connection which is served by a thread of its own, if threaded is set
+ **/
+typedef struct {
+	GArray *servers;	/**< the array of servers; the serving thread
+				     may keep pointers into it, so it is
+				     never changed once it has been handed
+				     to a thread */
+	int net;		/**< the socket of the connection */
+	SERVER *serve;		/**< the server the connection is for, or
+				     NULL if it came in on a modern socket */
+	guint connections;	/**< number of connections which were being
+				     served when this one came in */
+	CLIENT *client;		/**< the client, once it has been set up */
+} CONN_THREAD;
+
+gint connthreads = 0;	  /**< number of connection threads, if threaded
+			       is set */
+pthread_key_t connthread_key; /**< the CONN_THREAD of the current thread,
+				   or NULL if it isn't a connection thread */
+#define CONN_THREAD_STACK (256*1024) /**< stack size of a connection thread;
+					  the request buffer isn't on it */
+
+GArray *workers = NULL;	  /**< the pre-forked workers, if prefork is set */
+int workergen = 0;	  /**< incremented on SIGHUP; workers started before
+			       that have an outdated list of servers, so they
+			       are replaced as soon as they're idle */
+
+/**
+ * Count the connections which are being served, which is every child
+ * except the idle workers, and every connection thread.
+ **/
+static guint count_connections(void) {
+	guint n = g_hash_table_size(children) + g_atomic_int_get(&connthreads);
+	int i;
+
+	for(i=0; workers && i<workers->len; i++) {
+		if(g_array_index(workers, WORKER, i).idle && n > 0) {
+			n--;
+		}
+	}
+	return n;
+}
+
+/**
+ * Let the other listeners know how many connections we serve.
+ * Connection threads keep that number up to date themselves, see
+ * count_thread().
+ **/
+static void publish_connections(void) {
+	if(listenerconns && !(glob_flags & F_THREADED)) {
+		g_atomic_int_set(&listenerconns[listener_idx], count_connections());
+	}
+}
+
+/**
+ * Count the connections which all listeners together are serving.
+ **/
+static guint count_all_connections(void) {
+	guint n = count_connections();
+	int i;
+
+	for(i=0; listenerconns && i<listeners; i++) {
+		if(i != listener_idx) {
+			n += g_atomic_int_get(&listenerconns[i]);
+		}
+	}
+	return n;
+}
+
+/**
+ * Add to or subtract from the number of connection threads.
+ *
+ * @param delta 1 for a thread which starts, -1 for one which ends
+ **/
+static void count_thread(int delta) {
+	g_atomic_int_add(&connthreads, delta);
+	if(listenerconns) {
+		g_atomic_int_add(&listenerconns[listener_idx], delta);
+	}
+}
+
+/**
+ * In a worker or a connection thread, free what's left of a client
+ * after serveconnection(), closing the files of its export unless they
+ * came from the export registry.
+ **/
+static void release_client(CLIENT *client) {
+	if(client->cached) {
+		pthread_mutex_lock(&exportlock);
+		unref_export(client->cached);
+		pthread_mutex_unlock(&exportlock);
+	} else if(client->export) {
+		close_export(client->export);
+		put_block_cache(client->blockcache);
+	}
+	if(client->transactionlogfd != -1) {
+		close(client->transactionlogfd);
+	}
+	/* Left behind if the connection wasn't closed properly */
+	if(client->difffilename) {
+		close(client->difffile);
+		if(client->difffiledsync >= 0) {
+			close(client->difffiledsync);
+		}
+		cowmap_free(client->difmap);
+		free(client->difffilename);
+	}
+	g_free(client->exportname);
+	g_free(client->clientname);
+	g_free(client);
+}
+
+/**
+ * In a process which was forked to serve connections, close the sockets
+ * which only the parent should have open.
  **/
-void destroy_pid_t(gpointer data) {
-	g_free(data);
+static void close_listeners(GArray *servers) {
+	int i;
+
+	for(i=0;i<servers->len;i++) {
+		if(g_array_index(servers, SERVER, i).socket >= 0) {
+			close(g_array_index(servers, SERVER, i).socket);
+		}
+	}
+	for(i=0;i<modernsocks->len;i++) {
+		close(g_array_index(modernsocks, int, i));
+	}
+	if(listenfd >= 0) {
+		close(listenfd);
+		listenfd = -1;
+	}
+	if(workers) {
+		for(i=0;i<workers->len;i++) {
+			close(g_array_index(workers, WORKER, i).fd);
+		}
+		g_array_free(workers, TRUE);
+		workers = NULL;
+	}
 }
 
-static void
-handle_connection(GArray *servers, int net, SERVER *serve, CLIENT *client)
-{
+/**
+ * Get a connection ready to be served, in the process which is going to
+ * serve it: negotiate with a modern client, and check whether it may
+ * connect.
+ *
+ * @param servers The array of servers
+ * @param net The socket of the connection
+ * @param serve The server the connection is for, or NULL if it came in
+ * on a modern socket, in which case negotiation selects the server
+ * @param connections The number of connections which were being served
+ * when this one came in
+ * @return The client, or NULL if the connection should be closed
+ **/
+static CLIENT *setup_client(GArray *servers, int net, SERVER *serve,
+			    guint connections) {
 	int sock_flags_old;
 	int sock_flags_new;
+	CLIENT *client;
 
-	if(serve->max_connections > 0 &&
-	   g_hash_table_size(children) >= serve->max_connections) {
-		msg(LOG_INFO, "Max connections reached");
-		goto handle_connection_out;
-	}
 	if((sock_flags_old = fcntl(net, F_GETFL, 0)) == -1) {
 		err("fcntl F_GETFL");
 	}
@@ -2217,7 +6003,17 @@ handle_connection(GArray *servers, int net, SERVER *serve, CLIENT *client)
 	    fcntl(net, F_SETFL, sock_flags_new) == -1) {
 		err("fcntl F_SETFL ~O_NONBLOCK");
 	}
-	if(!client) {
+	if(!serve) {
+		client = negotiate(net, NULL, servers, NEG_INIT | NEG_MODERN);
+		if(!client) {
+			return NULL;
+		}
+		if(client->server->max_connections > 0 &&
+		   connections >= client->server->max_connections) {
+			msg(LOG_INFO, "Max connections reached");
+			goto setup_client_out;
+		}
+	} else {
 		client = g_new0(CLIENT, 1);
 		client->server=serve;
 		client->exportsize=OFFT_MAX;
@@ -2225,20 +6021,389 @@ handle_connection(GArray *servers, int net, SERVER *serve, CLIENT *client)
 		client->transactionlogfd = -1;
 	}
 	if (set_peername(net, client)) {
-		goto handle_connection_out;
+		goto setup_client_out;
 	}
 	if (!authorized_client(client)) {
 		msg(LOG_INFO, "Unauthorized client");
-		goto handle_connection_out;
+		goto setup_client_out;
 	}
 	msg(LOG_INFO, "Authorized client");
+	return client;
+
+setup_client_out:
+	g_free(client);
+	return NULL;
+}
+
+/**
+ * The main loop of a pre-forked worker: wait for the parent to hand over
+ * a connection, serve it, and tell the parent we're idle again. Exits
+ * when the parent closes its end of the socket, or after prefork_recycle
+ * connections.
+ *
+ * @param servers The array of servers
+ * @param fd The worker's end of the socket to the parent
+ **/
+static void worker_loop(GArray *servers, int fd) {
+	WORKER_MSG wmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	CLIENT *client;
+	ssize_t ret;
+	int served = 0;
+	int net;
+
+	for(;;) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = &wmsg;
+		iov.iov_len = sizeof(wmsg);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		if((ret = recvmsg(fd, &mh, 0)) < 0 && errno == EINTR) {
+			continue;
+		}
+		if(ret != sizeof(wmsg)) {
+			exit(EXIT_SUCCESS);
+		}
+		cmsg = CMSG_FIRSTHDR(&mh);
+		if(!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+		   cmsg->cmsg_type != SCM_RIGHTS) {
+			err("Worker received a message without a connection");
+		}
+		memcpy(&net, CMSG_DATA(cmsg), sizeof(int));
+
+		client = setup_client(servers, net, wmsg.servidx < 0 ? NULL :
+				      &g_array_index(servers, SERVER, wmsg.servidx),
+				      wmsg.connections);
+		if(client) {
+			msg(LOG_INFO, "Starting to serve");
+			serveconnection(client);
+			release_client(client);
+		}
+		close(net);
+
+		if(prefork_recycle > 0 && ++served >= prefork_recycle) {
+			exit(EXIT_SUCCESS);
+		}
+		if(write(fd, "", 1) != 1) {
+			exit(EXIT_SUCCESS);
+		}
+	}
+}
+
+/**
+ * Start a pre-forked worker.
+ *
+ * @param servers The array of servers
+ **/
+static void spawn_worker(GArray *servers) {
+	WORKER worker;
+	sigset_t newset;
+	sigset_t oldset;
+	pid_t *pidp;
+	pid_t pid;
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		err_nonfatal("socketpair: %m");
+		return;
+	}
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGCHLD);
+	sigaddset(&newset, SIGTERM);
+	sigprocmask(SIG_BLOCK, &newset, &oldset);
+	if((pid = fork()) < 0) {
+		msg(LOG_INFO, "Could not fork (%s)", strerror(errno));
+		sigprocmask(SIG_SETMASK, &oldset, NULL);
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+	if(pid > 0) { /* parent */
+		close(sv[1]);
+		pidp = g_malloc(sizeof(pid_t));
+		*pidp = pid;
+		g_hash_table_insert(children, pidp, pidp);
+		sigprocmask(SIG_SETMASK, &oldset, NULL);
+		worker.pid = pid;
+		worker.fd = sv[0];
+		worker.idle = TRUE;
+		worker.generation = workergen;
+		g_array_append_val(workers, worker);
+		add_listener(sv[0], LISTEN_WORKER);
+		return;
+	}
+	/* worker */
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	sigprocmask(SIG_SETMASK, &oldset, NULL);
+	close(sv[0]);
+	close_listeners(servers);
+	g_hash_table_destroy(children);
+	children = NULL;
+	worker_loop(servers, sv[1]);
+}
+
+/**
+ * Stop using a worker. It exits once it notices that its socket has
+ * been closed, which for a busy worker is after its connection ends.
+ *
+ * @param i The index of the worker in the workers array
+ **/
+static void retire_worker(int i) {
+	int fd = g_array_index(workers, WORKER, i).fd;
+
+	remove_listener(fd);
+	close(fd);
+	g_array_remove_index_fast(workers, i);
+}
+
+/**
+ * Start workers until there are prefork idle ones.
+ **/
+static void top_up_workers(GArray *servers) {
+	int idle = 0;
+	int i;
+
+	for(i=0; i<workers->len; i++) {
+		if(g_array_index(workers, WORKER, i).idle) {
+			idle++;
+		}
+	}
+	for(; idle < prefork; idle++) {
+		spawn_worker(servers);
+	}
+}
+
+/**
+ * Handle a message from a worker on its socket: either it is idle again,
+ * or it has exited.
+ *
+ * @param servers The array of servers
+ * @param fd The socket to the worker
+ **/
+static void handle_worker_event(GArray *servers, int fd) {
+	WORKER *worker = NULL;
+	char buf[16];
+	ssize_t ret;
+	int i;
+
+	for(i=0; i<workers->len; i++) {
+		if(g_array_index(workers, WORKER, i).fd == fd) {
+			worker = &g_array_index(workers, WORKER, i);
+			break;
+		}
+	}
+	if(!worker) {
+		return;
+	}
+	while((ret = read(fd, buf, sizeof(buf))) > 0) {
+		worker->idle = TRUE;
+	}
+	if(ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+			errno != EINTR)) {
+		retire_worker(i);
+	} else if(worker->idle && worker->generation != workergen) {
+		retire_worker(i);
+	}
+	top_up_workers(servers);
+	publish_connections();
+}
+
+/**
+ * Hand a connection over to an idle worker.
+ *
+ * @param servers The array of servers
+ * @param net The socket of the connection; closed if it was handed over
+ * @param servidx The index of its server in servers, or LISTEN_MODERN
+ * @param connections The number of connections being served
+ * @return TRUE if a worker took the connection
+ **/
+static gboolean hand_to_worker(GArray *servers, int net, int servidx,
+			       guint connections) {
+	WORKER *worker;
+	WORKER_MSG wmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int flags = 0;
+	int i;
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	memset(&wmsg, 0, sizeof(wmsg));
+	wmsg.servidx = servidx;
+	wmsg.connections = connections;
+	for(i=0; workers && i<workers->len; i++) {
+		worker = &g_array_index(workers, WORKER, i);
+		if(!worker->idle || worker->generation != workergen) {
+			continue;
+		}
+		memset(&mh, 0, sizeof(mh));
+		memset(cbuf, 0, sizeof(cbuf));
+		iov.iov_base = &wmsg;
+		iov.iov_len = sizeof(wmsg);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &net, sizeof(int));
+		if(sendmsg(worker->fd, &mh, flags) != sizeof(wmsg)) {
+			/* It must have died; don't try it again */
+			worker->idle = FALSE;
+			continue;
+		}
+		worker->idle = FALSE;
+		close(net);
+		top_up_workers(servers);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * Clean up after a connection thread, whether it returns or err() ends
+ * it.
+ *
+ * @param data The CONN_THREAD of the thread
+ **/
+static void connection_thread_cleanup(void *data) {
+	CONN_THREAD *conn = data;
+
+	if(conn->client) {
+		release_client(conn->client);
+	}
+	close(conn->net);
+	g_free(conn);
+	count_thread(-1);
+}
+
+/**
+ * Installed as err_exit_hook if threaded is set: if err() is called in
+ * a connection thread, end just that thread rather than the server.
+ **/
+static void connection_thread_exit(void) {
+	if(pthread_getspecific(connthread_key)) {
+		pthread_exit(NULL);
+	}
+}
+
+/**
+ * The thread which serves a connection, if threaded is set. The
+ * equivalent of the child process which is forked otherwise.
+ *
+ * @param data The CONN_THREAD of the connection
+ **/
+static void *connection_thread(void *data) {
+	CONN_THREAD *conn = data;
+
+	pthread_setspecific(connthread_key, conn);
+	pthread_cleanup_push(connection_thread_cleanup, conn);
+	conn->client = setup_client(conn->servers, conn->net, conn->serve,
+				    conn->connections);
+	if(conn->client) {
+		msg(LOG_INFO, "Starting to serve");
+		serveconnection(conn->client);
+	}
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/**
+ * Start a thread to serve a connection.
+ *
+ * @param servers The array of servers
+ * @param net The socket of the connection; closed by the thread
+ * @param serve The server the connection is for, or NULL
+ * @param connections The number of connections being served
+ **/
+static void start_connection_thread(GArray *servers, int net, SERVER *serve,
+				    guint connections) {
+	CONN_THREAD *conn = g_new0(CONN_THREAD, 1);
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t newset;
+	sigset_t oldset;
+	int e;
+
+	conn->servers = servers;
+	conn->net = net;
+	conn->serve = serve;
+	conn->connections = connections;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, CONN_THREAD_STACK);
+	/* Signals are handled by the thread running serveloop() */
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGCHLD);
+	sigaddset(&newset, SIGTERM);
+	sigaddset(&newset, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	count_thread(1);
+	if((e = pthread_create(&thread, &attr, connection_thread, conn))) {
+		msg(LOG_INFO, "Could not start thread (%s)", strerror(e));
+		count_thread(-1);
+		close(net);
+		g_free(conn);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Handle a connection which was just accepted. With threaded, a thread
+ * is started for it. Otherwise, it is handed over to an idle
+ * pre-forked worker if there is one, and a new process is forked for
+ * it if not. Negotiation, authorization and serving the export
+ * all happen in that process, so that a client which is slow to
+ * negotiate does not hold up the others.
+ *
+ * @param servers The array of servers
+ * @param net The socket of the connection
+ * @param servidx The index of its server in servers, or LISTEN_MODERN
+ **/
+static void
+handle_connection(GArray *servers, int net, int servidx)
+{
+	SERVER *serve = NULL;
+	CLIENT *client;
+	guint connections;
+
+	if(servidx >= 0) {
+		serve = &g_array_index(servers, SERVER, servidx);
+	}
+	connections = count_all_connections();
+	if(serve && serve->max_connections > 0 &&
+	   connections >= serve->max_connections) {
+		msg(LOG_INFO, "Max connections reached");
+		close(net);
+		return;
+	}
+
+	if (glob_flags & F_THREADED) {
+		start_connection_thread(servers, net, serve, connections);
+		return;
+	}
 
 	if (!dontfork) {
 		pid_t pid;
-		int i;
 		sigset_t newset;
 		sigset_t oldset;
 
+		if(hand_to_worker(servers, net, servidx, connections)) {
+			return;
+		}
 		sigemptyset(&newset);
 		sigaddset(&newset, SIGCHLD);
 		sigaddset(&newset, SIGTERM);
@@ -2246,7 +6411,8 @@ handle_connection(GArray *servers, int net, SERVER *serve, CLIENT *client)
 		if ((pid = fork()) < 0) {
 			msg(LOG_INFO, "Could not fork (%s)", strerror(errno));
 			sigprocmask(SIG_SETMASK, &oldset, NULL);
-			goto handle_connection_out;
+			close(net);
+			return;
 		}
 		if (pid > 0) { /* parent */
 			pid_t *pidp;
@@ -2255,20 +6421,29 @@ handle_connection(GArray *servers, int net, SERVER *serve, CLIENT *client)
 			*pidp = pid;
 			g_hash_table_insert(children, pidp, pidp);
 			sigprocmask(SIG_SETMASK, &oldset, NULL);
-			goto handle_connection_out;
+			close(net);
+			return;
 		}
 		/* child */
 		signal(SIGCHLD, SIG_DFL);
 		signal(SIGTERM, SIG_DFL);
 		signal(SIGHUP, SIG_DFL);
 		sigprocmask(SIG_SETMASK, &oldset, NULL);
+		close_listeners(servers);
+	}
+
+	client = setup_client(servers, net, serve, connections);
+	if(!client) {
+		close(net);
+		if(!dontfork) {
+			exit(EXIT_SUCCESS);
+		}
+		return;
+	}
 
+	if (!dontfork) {
 		g_hash_table_destroy(children);
 		children = NULL;
-		for(i=0;i<servers->len;i++) {
-			serve=&g_array_index(servers, SERVER, i);
-			close(serve->socket);
-		}
 		/* FALSE does not free the
 		   actual data. This is required,
 		   because the client has a
@@ -2276,19 +6451,12 @@ handle_connection(GArray *servers, int net, SERVER *serve, CLIENT *client)
 		   data, and otherwise we get a
 		   segfault... */
 		g_array_free(servers, FALSE);
-		for(i=0;i<modernsocks->len;i++) {
-			close(g_array_index(modernsocks, int, i));
-		}
 		g_array_free(modernsocks, TRUE);
 	}
 
 	msg(LOG_INFO, "Starting to serve");
 	serveconnection(client);
 	exit(EXIT_SUCCESS);
-
-handle_connection_out:
-	g_free(client);
-	close(net);
 }
 
 /**
@@ -2357,37 +6525,95 @@ out:
         return retval;
 }
 
+/**
+ * Accept all pending connections on a listening socket, and hand each
+ * of them to handle_connection().
+ *
+ * @param servers The array of servers
+ * @param sock The listening socket
+ * @param servidx The index of its server in servers, or LISTEN_MODERN
+ **/
+static void accept_connections(GArray* servers, int sock, int servidx) {
+	struct sockaddr_storage addrin;
+	socklen_t addrinlen;
+	int net;
+
+	for(;;) {
+		addrinlen = sizeof(addrin);
+		/* The connection is used with blocking I/O, starting with
+		 * the negotiation; only the listening socket is
+		 * non-blocking */
+#ifdef HAVE_ACCEPT4
+		net = accept4(sock, (struct sockaddr *) &addrin, &addrinlen,
+			      SOCK_CLOEXEC);
+#else
+		if((net = accept(sock, (struct sockaddr *) &addrin, &addrinlen)) >= 0) {
+			/* Some systems let it inherit O_NONBLOCK */
+			fcntl(net, F_SETFL, fcntl(net, F_GETFL, 0) & ~O_NONBLOCK);
+			fcntl(net, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+		if(net < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				err_nonfatal("accept: %m");
+			return;
+		}
+		handle_connection(servers, net, servidx);
+		publish_connections();
+	}
+}
+
 /**
  * Loop through the available servers, and serve them. Never returns.
  **/
 void serveloop(GArray* servers) {
-	struct sockaddr_storage addrin;
-	socklen_t addrinlen=sizeof(addrin);
 	int i;
-	int max;
-	int sock;
-	fd_set mset;
+	int n;
+#ifdef USE_EPOLL
+	struct epoll_event events[LISTEN_MAXEVENTS];
+	uint64_t data;
+#else
 	fd_set rset;
+	int sock;
+#endif
 
 	/* 
-	 * Set up the master fd_set. The set of descriptors we need
-	 * to select() for never changes anyway and it buys us a *lot*
-	 * of time to only build this once. However, if we ever choose
-	 * to not fork() for clients anymore, we may have to revisit
-	 * this.
+	 * Set up the set of listening sockets. It only changes when
+	 * SIGHUP adds new servers, so it is built once here rather
+	 * than for every wakeup.
 	 */
-	max=0;
-	FD_ZERO(&mset);
+#ifdef USE_EPOLL
+	if((listenfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		err("epoll_create1: %m");
+	}
+#else
+	FD_ZERO(&listenset);
+#endif
 	for(i=0;i<servers->len;i++) {
-		if((sock=(g_array_index(servers, SERVER, i)).socket) >= 0) {
-			FD_SET(sock, &mset);
-			max=sock>max?sock:max;
+		if((g_array_index(servers, SERVER, i)).socket >= 0) {
+			add_listener(g_array_index(servers, SERVER, i).socket, i);
 		}
 	}
 	for(i=0;i<modernsocks->len;i++) {
-		int sock = g_array_index(modernsocks, int, i);
-		FD_SET(sock, &mset);
-		max=sock>max?sock:max;
+		add_listener(g_array_index(modernsocks, int, i), LISTEN_MODERN);
+	}
+	exportcache = g_hash_table_new(g_direct_hash, g_direct_equal);
+	exportcacheowner = getpid();
+	fill_export_cache(servers);
+	if(glob_flags & F_THREADED) {
+		if(pthread_key_create(&connthread_key, NULL)) {
+			err("pthread_key_create: %m");
+		}
+		err_exit_hook = connection_thread_exit;
+		/* A client which goes away while we write to it must end
+		 * its own thread only, through the error the write returns,
+		 * rather than the whole server */
+		signal(SIGPIPE, SIG_IGN);
+	} else if(prefork > 0 && !dontfork) {
+		workers = g_array_new(FALSE, FALSE, sizeof(WORKER));
+		top_up_workers(servers);
 	}
 	for(;;) {
                 /* SIGHUP causes the root server process to reconfigure
@@ -2397,13 +6623,23 @@ void serveloop(GArray* servers) {
                  * export. This does not alter old runtime configuration
                  * but just appends new exports. */
                 if (is_sighup_caught) {
-                        int n;
                         GError *gerror = NULL;
 
                         msg(LOG_INFO, "reconfiguration request received");
                         is_sighup_caught = 0; /* Reset to allow catching
                                                * it again. */
 
+                        /* Connection threads have pointers into the
+                         * array, so it must not be reallocated under
+                         * them; leave it to them and work on a copy */
+                        if (glob_flags & F_THREADED) {
+                                servers = g_array_append_vals(
+                                        g_array_sized_new(FALSE, FALSE,
+                                                          sizeof(SERVER),
+                                                          servers->len),
+                                        servers->data, servers->len);
+                        }
+
                         n = append_new_servers(servers, &gerror);
                         if (n == -1)
                                 msg(LOG_ERR, "failed to append new servers: %s",
@@ -2414,54 +6650,85 @@ void serveloop(GArray* servers) {
                                                                     SERVER, i);
 
                                 if (server.socket >= 0) {
-                                        FD_SET(server.socket, &mset);
-                                        max = server.socket > max ? server.socket : max;
+                                        add_listener(server.socket, i);
                                 }
 
                                 msg(LOG_INFO, "reconfigured new server: %s",
                                     server.servename);
                         }
+
+                        /* Exports are opened again, in case their files
+                         * were replaced */
+                        flush_export_cache();
+                        fill_export_cache(servers);
+                        setup_shared_caches(servers);
+
+                        /* The other listeners reconfigure themselves */
+                        for (i = 0; listenerpids && i < listenerpids->len; ++i) {
+                                kill(g_array_index(listenerpids, pid_t, i),
+                                     SIGHUP);
+                        }
+
+                        /* Workers know only the servers there were when
+                         * they were started */
+                        if (workers) {
+                                workergen++;
+                                for (i = workers->len - 1; i >= 0; --i) {
+                                        if (g_array_index(workers, WORKER, i).idle)
+                                                retire_worker(i);
+                                }
+                                top_up_workers(servers);
+                        }
                 }
 
-		memcpy(&rset, &mset, sizeof(fd_set));
-		if(select(max+1, &rset, NULL, NULL, NULL)>0) {
-			int net;
+		if (is_export_stale) {
+			is_export_stale = 0;
+			refresh_export_cache(servers);
+		}
 
+#ifdef USE_EPOLL
+		n = epoll_wait(listenfd, events, LISTEN_MAXEVENTS, -1);
+		if(n < 0 && errno != EINTR) {
+			err("epoll_wait: %m");
+		}
+		DEBUG("accept, ");
+		for(i=0; i < n; i++) {
+			data = events[i].data.u64;
+			if((int32_t)(data >> 32) == LISTEN_WORKER) {
+				handle_worker_event(servers, (int)(uint32_t)data);
+			} else {
+				accept_connections(servers, (int)(uint32_t)data,
+						   (int32_t)(data >> 32));
+			}
+		}
+#else
+		memcpy(&rset, &listenset, sizeof(fd_set));
+		if(select(listenmax+1, &rset, NULL, NULL, NULL)>0) {
 			DEBUG("accept, ");
 			for(i=0; i < modernsocks->len; i++) {
-				int sock = g_array_index(modernsocks, int, i);
-				if(!FD_ISSET(sock, &rset)) {
-					continue;
+				sock = g_array_index(modernsocks, int, i);
+				if(FD_ISSET(sock, &rset)) {
+					accept_connections(servers, sock, LISTEN_MODERN);
 				}
-				CLIENT *client;
-
-				if((net=accept(sock, (struct sockaddr *) &addrin, &addrinlen)) < 0) {
-					err_nonfatal("accept: %m");
-					continue;
-				}
-				client = negotiate(net, NULL, servers, NEG_INIT | NEG_MODERN);
-				if(!client) {
-					close(net);
-					continue;
+			}
+			for(i=0; workers && i < workers->len; i++) {
+				sock = g_array_index(workers, WORKER, i).fd;
+				if(FD_ISSET(sock, &rset)) {
+					/* may remove the worker from the
+					 * array, so look at it again */
+					FD_CLR(sock, &rset);
+					handle_worker_event(servers, sock);
+					i = -1;
 				}
-				handle_connection(servers, net, client->server, client);
 			}
 			for(i=0; i < servers->len; i++) {
-				SERVER *serve;
-
-				serve=&(g_array_index(servers, SERVER, i));
-				if(sock < 0) {
-					continue;
-				}
-				if(FD_ISSET(serve->socket, &rset)) {
-					if ((net=accept(serve->socket, (struct sockaddr *) &addrin, &addrinlen)) < 0) {
-						err_nonfatal("accept: %m");
-						continue;
-					}
-					handle_connection(servers, net, serve, NULL);
+				sock = g_array_index(servers, SERVER, i).socket;
+				if(sock >= 0 && FD_ISSET(sock, &rset)) {
+					accept_connections(servers, sock, i);
 				}
 			}
 		}
+#endif
 	}
 }
 void serveloop(GArray* servers) G_GNUC_NORETURN;
@@ -2538,7 +6805,8 @@ int setup_serve(SERVER *const serve, GError **const gerror) {
          * TODO: fix server initialization */
         serve->socket = -1;
 
-	if(!(glob_flags & F_OLDSTYLE)) {
+	/* Oldstyle ports are served by the first listener only */
+	if(!(glob_flags & F_OLDSTYLE) || listener_idx > 0) {
 		return serve->servename ? 1 : 0;
 	}
 	memset(&hints,'\0',sizeof(hints));
@@ -2631,6 +6899,7 @@ int open_modern(const gchar *const addr, const gchar *const port,
         int retval = -1;
 	int i=0;
 	int sock = -1;
+	int yes = 1;
 
 	memset(&hints, '\0', sizeof(hints));
 	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
@@ -2662,6 +6931,18 @@ int open_modern(const gchar *const addr, const gchar *const port,
 			g_prefix_error(gerror, "failed to open a modern socket: ");
 			goto out;
 		}
+#ifdef SO_REUSEPORT
+		/* Every listener binds a socket of its own to the port, and
+		 * the kernel spreads connections over them */
+		if (listeners > 1 &&
+		    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_SO_REUSEPORT,
+				    "failed to open a modern socket: "
+				    "failed to set socket option SO_REUSEPORT: %s",
+				    strerror(errno));
+			goto out;
+		}
+#endif
 
 		if(bind(sock, ai->ai_addr, ai->ai_addrlen)) {
 			/* This is so wrong. 
@@ -2744,12 +7025,17 @@ void setup_servers(GArray *const servers, const gchar *const modernaddr,
 	}
 	children=g_hash_table_new_full(g_int_hash, g_int_equal, NULL, destroy_pid_t);
 
-	sa.sa_handler = sigchld_handler;
-	sigemptyset(&sa.sa_mask);
-	sigaddset(&sa.sa_mask, SIGTERM);
-	sa.sa_flags = SA_RESTART;
-	if(sigaction(SIGCHLD, &sa, NULL) == -1)
-		err("sigaction: %m");
+	/* A threaded server has no children; the only processes it starts
+	 * are the prerun and postrun commands, which system() must be able
+	 * to wait for itself */
+	if(!(glob_flags & F_THREADED)) {
+		sa.sa_handler = sigchld_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaddset(&sa.sa_mask, SIGTERM);
+		sa.sa_flags = SA_RESTART;
+		if(sigaction(SIGCHLD, &sa, NULL) == -1)
+			err("sigaction: %m");
+	}
 
 	sa.sa_handler = sigterm_handler;
 	sigemptyset(&sa.sa_mask);
@@ -2763,6 +7049,75 @@ void setup_servers(GArray *const servers, const gchar *const modernaddr,
 	sa.sa_flags = SA_RESTART;
 	if(sigaction(SIGHUP, &sa, NULL) == -1)
 		err("sigaction: %m");
+
+	sa.sa_handler = export_stale_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if(sigaction(SIGUSR1, &sa, NULL) == -1)
+		err("sigaction: %m");
+}
+
+/**
+ * Fork the processes which accept connections on the modern port next
+ * to us, if the listeners option asks for more than one. Each of them
+ * opens a socket of its own on the port, which SO_REUSEPORT allows, so
+ * that the kernel spreads connections over them; apart from that, they
+ * are servers like us. This must be done before giving up root, in
+ * case the port is a privileged one.
+ *
+ * @param servers The array of servers
+ * @param modernaddr The address of the modern socket
+ * @param modernport The port of the modern socket
+ **/
+void start_listeners(GArray *const servers, const gchar *const modernaddr,
+		     const gchar *const modernport) {
+	GError *gerror = NULL;
+	pid_t pid;
+	int i;
+	int j;
+
+	if(listeners < 2 || !modernsocks->len) {
+		return;
+	}
+	listenerconns = mmap(NULL, listeners * sizeof(gint),
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			     -1, 0);
+	if(listenerconns == MAP_FAILED) {
+		err("mmap: %m");
+	}
+	listenerpids = g_array_new(FALSE, FALSE, sizeof(pid_t));
+	for(i=1; i<listeners; i++) {
+		if((pid = fork()) < 0) {
+			msg(LOG_ERR, "Could not fork listener (%s)", strerror(errno));
+			return;
+		}
+		if(pid > 0) {
+			g_array_append_val(listenerpids, pid);
+			continue;
+		}
+		/* child */
+		listener_idx = i;
+		g_array_free(listenerpids, TRUE);
+		listenerpids = NULL;
+		for(j=0; j<servers->len; j++) {
+			SERVER *serve = &g_array_index(servers, SERVER, j);
+
+			if(serve->socket >= 0) {
+				close(serve->socket);
+				serve->socket = -1;
+			}
+		}
+		for(j=0; j<modernsocks->len; j++) {
+			close(g_array_index(modernsocks, int, j));
+		}
+		g_array_set_size(modernsocks, 0);
+		if(open_modern(modernaddr, modernport, &gerror) == -1) {
+			msg(LOG_ERR, "failed to set up listener %d: %s", i,
+			    gerror->message);
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
 }
 
 /**
@@ -2887,6 +7242,10 @@ int main(int argc, char *argv[]) {
 
 	memset(pidftemplate, '\0', 256);
 
+#if !GLIB_CHECK_VERSION(2,31,0)
+	g_thread_init(NULL);
+#endif
+
 	modernsocks = g_array_new(FALSE, FALSE, sizeof(int));
 
 	logging();
@@ -2917,10 +7276,11 @@ int main(int argc, char *argv[]) {
 			open("/dev/null", O_WRONLY);
 			g_log_set_default_handler( glib_message_syslog_redirect, NULL );
 #endif
-			client=g_malloc(sizeof(CLIENT));
+			client=g_new0(CLIENT, 1);
 			client->server=serve;
 			client->net=-1;
 			client->exportsize=OFFT_MAX;
+			client->transactionlogfd = -1;
 			if (set_peername(0, client))
 				exit(EXIT_FAILURE);
 			serveconnection(client);
@@ -2947,8 +7307,19 @@ int main(int argc, char *argv[]) {
 	}
 	if (!dontfork)
 		daemonize(serve);
+	if (genconf.listeners > 1) {
+#ifdef SO_REUSEPORT
+		listeners = genconf.listeners;
+#else
+		g_warning("SO_REUSEPORT is not supported on this platform; ignoring listeners");
+#endif
+	}
 	setup_servers(servers, genconf.modernaddr, genconf.modernport);
+	setup_shared_caches(servers);
+	start_listeners(servers, genconf.modernaddr, genconf.modernport);
 	dousers(genconf.user, genconf.group);
+	prefork = genconf.prefork;
+	prefork_recycle = genconf.prefork_recycle;
 
 	serveloop(servers);
 }
@@ -692,6 +692,112 @@ err:
 	return retval;
 }
 
+int trim_test(gchar* hostname, int port, char* name, int sock,
+	      char sock_is_open, char close_sock, int testflags) {
+	struct nbd_request req;
+	uint64_t i;
+	int retval=0;
+	int serverflags = 0;
+
+	size=0;
+	if(!sock_is_open) {
+		if((sock=setup_connection(hostname, port, name, CONNECTION_TYPE_FULL, &serverflags))<0) {
+			g_warning("Could not open socket: %s", errstr);
+			retval=-1;
+			goto err;
+		}
+	}
+	if(!(serverflags & NBD_FLAG_SEND_TRIM)) {
+		snprintf(errstr, errstr_len, "Server did not supply trim capability flag");
+		retval=-1;
+		goto err_open;
+	}
+	req.magic=htonl(NBD_REQUEST_MAGIC);
+	req.type=htonl(NBD_CMD_TRIM);
+	for(i=0;i<size;i+=1024*1024) {
+		req.len=htonl((size - i < 1024*1024) ? size - i : 1024*1024);
+		req.from=htonll(i);
+		memcpy(&(req.handle),&i,sizeof(i));
+		WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1, "Could not write request: %s", strerror(errno));
+		if(read_packet_check_header(sock, 0, i)<0) {
+			retval=-1;
+			goto err_open;
+		}
+	}
+	g_message("%d: Trim test complete. Trimmed %llu bytes", (int)getpid(), (unsigned long long)size);
+
+err_open:
+	if(close_sock) {
+		close_connection(sock, CONNECTION_CLOSE_PROPERLY);
+	}
+err:
+	return retval;
+}
+
+int ranged_flush_test(gchar* hostname, int port, char* name, int sock,
+	      char sock_is_open, char close_sock, int testflags) {
+	struct nbd_request req;
+	uint64_t i;
+	int retval=0;
+	int serverflags = 0;
+	char buf[4096];
+
+	size=0;
+	if(!sock_is_open) {
+		if((sock=setup_connection(hostname, port, name, CONNECTION_TYPE_FULL, &serverflags))<0) {
+			g_warning("Could not open socket: %s", errstr);
+			retval=-1;
+			goto err;
+		}
+	}
+	if(!(serverflags & NBD_FLAG_SEND_RANGED_FLUSH)) {
+		snprintf(errstr, errstr_len, "Server did not supply ranged flush capability flag");
+		retval=-1;
+		goto err_open;
+	}
+	memset(buf, 0xA5, sizeof(buf));
+	req.magic=htonl(NBD_REQUEST_MAGIC);
+	for(i=0;i<size;i+=1024*1024) {
+		/* dirty one page of this megabyte, then flush just that
+		 * megabyte */
+		req.type=htonl(NBD_CMD_WRITE);
+		req.len=htonl(sizeof(buf));
+		req.from=htonll(i);
+		memcpy(&(req.handle),&i,sizeof(i));
+		WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1, "Could not write request: %s", strerror(errno));
+		WRITE_ALL_ERR_RT(sock, buf, sizeof(buf), err_open, -1, "Could not write data: %s", strerror(errno));
+		if(read_packet_check_header(sock, 0, i)<0) {
+			retval=-1;
+			goto err_open;
+		}
+		req.type=htonl(NBD_CMD_FLUSH);
+		req.len=htonl((size - i < 1024*1024) ? size - i : 1024*1024);
+		WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1, "Could not write request: %s", strerror(errno));
+		if(read_packet_check_header(sock, 0, i)<0) {
+			retval=-1;
+			goto err_open;
+		}
+	}
+	/* and a flush of the whole device, which has nothing left to do */
+	req.type=htonl(NBD_CMD_FLUSH);
+	req.len=0;
+	req.from=0;
+	memcpy(&(req.handle),&i,sizeof(i));
+	WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1, "Could not write request: %s", strerror(errno));
+	if(read_packet_check_header(sock, 0, i)<0) {
+		retval=-1;
+		goto err_open;
+	}
+	g_message("%d: Ranged flush test complete. Flushed %llu bytes", (int)getpid(), (unsigned long long)size);
+
+err_open:
+	if(close_sock) {
+		close_connection(sock, CONNECTION_CLOSE_PROPERLY);
+	}
+err:
+	return retval;
+}
+
 /*
  * fill 512 byte buffer 'buf' with a hashed selection of interesting data based
  * only on handle and blknum. The first word is blknum, and the second handle, for ease
@@ -1285,7 +1391,7 @@ int main(int argc, char**argv) {
 		exit(EXIT_FAILURE);
 	}
 	logging();
-	while((c=getopt(argc, argv, "-N:t:owfil"))>=0) {
+	while((c=getopt(argc, argv, "-N:t:owfilTR"))>=0) {
 		switch(c) {
 			case 1:
 				handle_nonopt(optarg, &hostname, &p);
@@ -1314,6 +1420,12 @@ int main(int argc, char**argv) {
 			case 'i':
 				test=integrity_test;
 				break;
+			case 'T':
+				test=trim_test;
+				break;
+			case 'R':
+				test=ranged_flush_test;
+				break;
 		}
 	}
 